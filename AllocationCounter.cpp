@@ -0,0 +1,76 @@
+#include "stdafx.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <new>
+
+#include "AllocationCounter.h"
+
+/*
+ * Replaces the allocation functions to count heap allocations. With glibc, malloc
+ * and its relatives are replaced so that the buffers of OpenCV matrices, which are
+ * not made with operator new, are counted too. Elsewhere only operator new is.
+ *
+ * Every allocation updates one shared counter, so this is only linked into the
+ * benchmark build. See the makefile.
+ */
+
+static long allocations = 0;
+
+long heapAllocations()
+{
+	return allocations;
+}
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) __THROW
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) __THROW
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) __THROW
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_realloc(p, size);
+}
+
+void *memalign(size_t alignment, size_t size) __THROW
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size) __THROW
+{
+	__sync_fetch_and_add(&allocations, 1);
+	*p = __libc_memalign(alignment, size);
+	return *p ? 0 : ENOMEM;
+}
+}
+#else
+void* operator new(size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p)
+{
+	free(p);
+}
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+/*
+ * Counting of heap allocations for the benchmarks. AllocationCounter.cpp replaces
+ * the allocation functions to count them, so it is only linked into the benchmark
+ * build (make bench), not into ec-plates itself.
+ */
+
+// Number of heap allocations made so far, or -1 when they are not counted
+long heapAllocations();
@@ -0,0 +1,271 @@
+#include "stdafx.h"
+#include "BitPlane.h"
+#include "Parallel.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+void BitPlane::create(int rows, int cols)
+{
+	this->rows = rows;
+	this->cols = cols;
+	wordsPerRow = (cols + 63) / 64;
+	words.assign((size_t)rows * wordsPerRow, 0);
+}
+
+void BitPlane::toMask(Mat& mask) const
+{
+	mask.create(rows, cols, CV_8U);
+	for (int y=0;y<rows;y++)
+	{
+		const uint64_t *src = row(y);
+		unsigned char *dst = mask.ptr<unsigned char>(y);
+		for (int x=0;x<cols;x++)
+			dst[x] = (src[x >> 6] >> (x & 63)) & 1 ? 255 : 0;
+	}
+}
+
+/*
+ * Packs a band of rows of a classified image
+ */
+class PackClassesBody : public ParallelLoopBody
+{
+public:
+	PackClassesBody(const Mat& classified, const int *classes, BitPlane *planes, int numPlanes) :
+		classified(classified), classes(classes), planes(planes), numPlanes(numPlanes) {
+	}
+
+	void operator()(const Range& range) const {
+		for (int y=range.start;y<range.end;y++)
+		{
+			const unsigned char *src = classified.ptr<unsigned char>(y);
+			for (int p=0;p<numPlanes;p++)
+				packRow(src, classes[p], planes[p].row(y));
+		}
+	}
+
+private:
+	void packRow(const unsigned char *src, int cls, uint64_t *dst) const {
+		int cols = classified.cols;
+		int x = 0;
+#ifdef __SSE2__
+		// Compare 16 pixels at a time, taking one bit of each from the mask of bytes
+		__m128i value = _mm_set1_epi8((char)cls);
+		for (;x<=cols-64;x+=64)
+		{
+			uint64_t word = 0;
+			for (int k=0;k<4;k++)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + x + k*16));
+				uint64_t bits = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, value));
+				word |= bits << (k*16);
+			}
+			dst[x >> 6] = word;
+		}
+#endif
+		for (;x<cols;x+=64)
+		{
+			uint64_t word = 0;
+			int n = min(64, cols - x);
+			for (int b=0;b<n;b++)
+				word |= (uint64_t)(src[x + b] == cls) << b;
+			dst[x >> 6] = word;
+		}
+	}
+
+	const Mat& classified;
+	const int *classes;
+	BitPlane *planes;
+	int numPlanes;
+};
+
+void packClasses(const Mat& classified, const int *classes, BitPlane *planes, int numPlanes, int numThreads)
+{
+	for (int p=0;p<numPlanes;p++)
+		planes[p].create(classified.rows, classified.cols);
+	parallelForBands(classified.rows, numThreads, PackClassesBody(classified, classes, planes, numPlanes));
+}
+
+/*
+ * Combines pixels for erosion (and) or dilation (or)
+ */
+template<bool DILATE>
+static inline uint64_t combine(uint64_t a, uint64_t b)
+{
+	return DILATE ? (a | b) : (a & b);
+}
+
+/*
+ * Combines each pixel of a row of n words with its horizontal neighbors up to
+ * RADIUS (1 or 2) away. ext is the row extended as by loadRow
+ */
+template<bool DILATE, int RADIUS>
+static void horizontalRow(const uint64_t *ext, uint64_t *dst, int n)
+{
+	for (int i=0;i<n;i++)
+	{
+		uint64_t prev = ext[i-1], cur = ext[i], next = ext[i+1];
+
+		// Neighbors to the left are in lower bits, so shift up to bring them to each pixel
+		uint64_t v = combine<DILATE>(cur, combine<DILATE>((cur << 1) | (prev >> 63), (cur >> 1) | (next << 63)));
+		if (RADIUS == 2)
+			v = combine<DILATE>(v, combine<DILATE>((cur << 2) | (prev >> 62), (cur >> 2) | (next << 62)));
+		dst[i] = v;
+	}
+}
+
+/*
+ * Copies row y of a plane into ext[0..wordsPerRow), setting the word before and after
+ * and the bits beyond the last column to the border. Rows outside the plane are all border.
+ * ext must have a word before it.
+ */
+static void loadRow(const BitPlane& plane, int y, uint64_t border, uint64_t *ext)
+{
+	int n = plane.wordsPerRow;
+	ext[-1] = border;
+	ext[n] = border;
+	if (y < 0 || y >= plane.rows)
+	{
+		for (int i=0;i<n;i++)
+			ext[i] = border;
+		return;
+	}
+
+	const uint64_t *src = plane.row(y);
+	for (int i=0;i<n;i++)
+		ext[i] = src[i];
+	int used = plane.cols - (n - 1) * 64;
+	if (used < 64)
+		ext[n-1] |= border & (~0ULL << used);
+}
+
+/*
+ * Erodes or dilates bands of rows of several planes. Each source row is loaded
+ * and combined horizontally once, and kept while the output rows near it are made.
+ */
+class BitMorphBody : public ParallelLoopBody
+{
+public:
+	BitMorphBody(const BitPlane *src, BitPlane *dst, int numPlanes, BitMorphShape shape, bool dilate,
+		int numThreads, vector<vector<uint64_t> >& bands) :
+		src(src), dst(dst), numPlanes(numPlanes), shape(shape), dilate(dilate), numThreads(numThreads), bands(bands) {
+	}
+
+	void operator()(const Range& range) const {
+		if (shape == BIT_MORPH_CROSS3)
+		{
+			if (dilate)
+				run<true, BIT_MORPH_CROSS3>(range);
+			else
+				run<false, BIT_MORPH_CROSS3>(range);
+		}
+		else
+		{
+			if (dilate)
+				run<true, BIT_MORPH_ELLIPSE5>(range);
+			else
+				run<false, BIT_MORPH_ELLIPSE5>(range);
+		}
+	}
+
+private:
+	template<bool DILATE, BitMorphShape SHAPE>
+	void run(const Range& range) const {
+		// Outside of the image, erosion sees set pixels and dilation clear ones
+		uint64_t border = DILATE ? 0 : ~0ULL;
+		int n = src[0].wordsPerRow;
+		int used = src[0].cols - (n - 1) * 64;
+		int stride = n + 2;
+
+		// Rows y-R to y+R of each plane, in slots by row, as loaded and as combined horizontally
+		const int R = SHAPE == BIT_MORPH_CROSS3 ? 1 : 2;
+		const int slots = 2 * R + 1;
+		vector<uint64_t>& buf = bands[bandIndex(range.start, src[0].rows, numThreads)];
+		if (buf.size() < numPlanes * slots * (stride + n))
+			buf.resize(numPlanes * slots * (stride + n));
+
+		for (int p=0;p<numPlanes;p++)
+		{
+			uint64_t *ext = &buf[p * slots * stride];
+			uint64_t *horz = &buf[(numPlanes * stride + p * n) * slots];
+			for (int y=range.start;y<range.end;y++)
+			{
+				// Load the rows which have come into range
+				for (int r=(y == range.start ? y - R : y + R);r<=y+R;r++)
+				{
+					int slot = (r + slots * 2) % slots;
+					uint64_t *e = ext + slot * stride + 1;
+					loadRow(src[p], r, border, e);
+					horizontalRow<DILATE, R>(e, horz + slot * n, n);
+				}
+
+				uint64_t *out = dst[p].row(y);
+				const uint64_t *center = horz + ((y + slots * 2) % slots) * n;
+				if (SHAPE == BIT_MORPH_CROSS3)
+				{
+					// Center row with its neighbors, and the pixels above and below
+					const uint64_t *above = ext + ((y - 1 + slots * 2) % slots) * stride + 1;
+					const uint64_t *below = ext + ((y + 1 + slots * 2) % slots) * stride + 1;
+					for (int i=0;i<n;i++)
+						out[i] = combine<DILATE>(center[i], combine<DILATE>(above[i], below[i]));
+				}
+				else
+				{
+					// Full width on the three middle rows, and the centers of the outer rows
+					const uint64_t *above = horz + ((y - 1 + slots * 2) % slots) * n;
+					const uint64_t *below = horz + ((y + 1 + slots * 2) % slots) * n;
+					const uint64_t *top = ext + ((y - 2 + slots * 2) % slots) * stride + 1;
+					const uint64_t *bottom = ext + ((y + 2 + slots * 2) % slots) * stride + 1;
+					for (int i=0;i<n;i++)
+						out[i] = combine<DILATE>(combine<DILATE>(center[i], combine<DILATE>(above[i], below[i])),
+							combine<DILATE>(top[i], bottom[i]));
+				}
+
+				// Keep the bits beyond the last column clear
+				if (used < 64)
+					out[n-1] &= ~(~0ULL << used);
+			}
+		}
+	}
+
+	const BitPlane *src;
+	BitPlane *dst;
+	int numPlanes;
+	BitMorphShape shape;
+	bool dilate;
+	int numThreads;
+	vector<vector<uint64_t> >& bands;
+};
+
+void morphBitPlanes(BitPlane *planes, int numPlanes, const BitMorphOp *ops, int numOps, int numThreads,
+	BitMorphWorkspace *workspace)
+{
+	if (numPlanes == 0 || planes[0].rows == 0 || planes[0].cols == 0)
+		return;
+
+	BitMorphWorkspace localWorkspace;
+	BitMorphWorkspace& ws = workspace ? *workspace : localWorkspace;
+
+	// Each operation writes into the other set of planes, which then become the result
+	vector<BitPlane>& result = ws.result;
+	if (result.size() < numPlanes)
+		result.resize(numPlanes);
+	for (int p=0;p<numPlanes;p++)
+		result[p].create(planes[p].rows, planes[p].cols);
+
+	int numBands = bandCount(planes[0].rows, numThreads);
+	if (ws.bands.size() < numBands)
+		ws.bands.resize(numBands);
+
+	for (int k=0;k<numOps;k++)
+	{
+		parallelForBands(planes[0].rows, numThreads, 
+			BitMorphBody(planes, &result[0], numPlanes, ops[k].shape, ops[k].dilate, numThreads, ws.bands));
+		for (int p=0;p<numPlanes;p++)
+			planes[p].words.swap(result[p].words);
+	}
+}
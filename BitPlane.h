@@ -0,0 +1,64 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Binary image packed 64 pixels to a word, so that morphology works on a
+ * whole word of pixels per operation. Pixel x of a row is bit x % 64 of
+ * word x / 64. Bits beyond the last column are always zero.
+ */
+struct BitPlane
+{
+	int rows;
+	int cols;
+	int wordsPerRow;
+	std::vector<uint64_t> words;
+
+	BitPlane() : rows(0), cols(0), wordsPerRow(0) {
+	}
+
+	// Allocates the plane, with all pixels cleared
+	void create(int rows, int cols);
+
+	uint64_t* row(int y) { return &words[(size_t)y * wordsPerRow]; }
+	const uint64_t* row(int y) const { return &words[(size_t)y * wordsPerRow]; }
+
+	// Unpacks the plane into a CV_8U mask of 0 and 255
+	void toMask(cv::Mat& mask) const;
+};
+
+// Structuring elements supported by morphBitPlanes. These are the same as
+// getStructuringElement(MORPH_CROSS, Size(3, 3)) and (MORPH_ELLIPSE, Size(5, 5))
+enum BitMorphShape
+{
+	BIT_MORPH_CROSS3,
+	BIT_MORPH_ELLIPSE5
+};
+
+// An erosion or dilation, giving the same result as erode or dilate with the
+// structuring element and the default border
+struct BitMorphOp
+{
+	BitMorphShape shape;
+	bool dilate;
+};
+
+// Packs a CV_8U classified image into one bit plane per class in a single
+// pass: a pixel is set in planes[i] if its class is classes[i]
+void packClasses(const cv::Mat& classified, const int *classes, BitPlane *planes, int numPlanes, int numThreads);
+
+// Buffers of morphBitPlanes, kept between calls so that they are only 
+// allocated again when a plate needs more room
+struct BitMorphWorkspace
+{
+	std::vector<BitPlane> result;					// Planes written by each operation
+	std::vector<std::vector<uint64_t> > bands;		// Rows kept by each band
+};
+
+// Applies a sequence of erosions and dilations to each of the planes, which are
+// all the same size, in place. Each operation processes all planes in the same
+// sweep over the rows, split into numThreads bands (0 for all cores).
+void morphBitPlanes(BitPlane *planes, int numPlanes, const BitMorphOp *ops, int numOps, int numThreads,
+	BitMorphWorkspace *workspace = NULL);
@@ -2,6 +2,8 @@
 #include <opencv2/opencv.hpp>
 #include "Circle.h"
 #include "CircleFinder.h"
+#include "OpenCVActivityContext.h"
+#include "Parallel.h"
 
 
 using namespace cv;
@@ -9,17 +11,33 @@ using namespace cv;
 static void timeit(const char *name) {
 }
 
+CircleFinderParams::CircleFinderParams()
+{
+	seed = 0x2545F4914F6CDD1DULL;
+	numThreads = 1;
+	coarseToFine = false;
+	coarseSize = 256;
+	context = NULL;
+}
+
 /*
  * Finds the rectangle which fits around the Petri dish circle that has been detected
  */
-Rect findPetriRect(Mat img)
+Rect findPetriRect(Mat img, const CircleFinderParams& params)
+{
+	return petriRectFromCircle(findPetriDish(img, params));
+}
+
+/*
+ * Gets the rectangle which fits around a Petri dish circle
+ */
+Rect petriRectFromCircle(Vec3f circ)
 {
-	Vec3f circ = findPetriDish(img);
 	return Rect(circ[0]-circ[2], circ[1]-circ[2], circ[2]*2, circ[2]*2);
 }
 
 // maximum size of the image to process.  If larger, will be scaled
-static int maxSize = 1024;
+static int maxSize = PETRI_SEARCH_SIZE;
 
 // Finds edges in the image
 static Mat findEdges(Mat img)
@@ -36,6 +54,221 @@ static Mat findEdges(Mat img)
 	return edges;
 }
 
+/*
+ * Finds the contours of an edge image, reading each straight into the set
+ * instead of into a vector of its own
+ */
+void findContourSet(Mat edges, ContourSet& contours)
+{
+	// cvFindContours modifies the image
+	Mat image = edges.clone();
+	CvMat c_image = image;
+	MemStorage storage(cvCreateMemStorage());
+	CvSeq *first = NULL;
+	cvFindContours(&c_image, storage, &first, sizeof(CvContour), CV_RETR_LIST, CV_CHAIN_APPROX_NONE);
+
+	int total = 0;
+	for (CvSeq *seq=first;seq;seq=seq->h_next)
+		total += seq->total;
+
+	contours.points.resize(total);
+	contours.starts.clear();
+	int pos = 0;
+	for (CvSeq *seq=first;seq;seq=seq->h_next)
+	{
+		contours.starts.push_back(pos);
+		cvCvtSeqToArray(seq, &contours.points[pos]);
+		pos += seq->total;
+	}
+	contours.starts.push_back(pos);
+}
+
+/*
+ * Removes contours whose bounding box is not larger than minSize in either
+ * direction or which have fewer than minPoints points
+ */
+void removeSmallContours(ContourSet& contours, int minSize, int minPoints)
+{
+	int pos = 0, kept = 0;
+	for (int c=0;c<contours.count();c++)
+	{
+		int start = contours.starts[c], end = contours.starts[c+1];
+		if (end - start < minPoints)
+			continue;
+
+		Point lo = contours.points[start], hi = lo;
+		for (int i=start+1;i<end;i++)
+		{
+			const Point& p = contours.points[i];
+			lo.x = min(lo.x, p.x); lo.y = min(lo.y, p.y);
+			hi.x = max(hi.x, p.x); hi.y = max(hi.y, p.y);
+		}
+		if (hi.x - lo.x + 1 <= minSize && hi.y - lo.y + 1 <= minSize)
+			continue;
+
+		// Move contour down over removed ones
+		copy(contours.points.begin() + start, contours.points.begin() + end, contours.points.begin() + pos);
+		contours.starts[kept++] = pos;
+		pos += end - start;
+	}
+	contours.points.resize(pos);
+	contours.starts.resize(kept);
+	contours.starts.push_back(pos);
+}
+
+/*
+ * Removes the points of contours further than maxDist from center, and contours
+ * which are left empty
+ */
+void removeOutsidePoints(ContourSet& contours, Point center, double maxDist)
+{
+	int pos = 0, kept = 0;
+	for (int c=0;c<contours.count();c++)
+	{
+		int start = pos;
+		for (int i=contours.starts[c];i<contours.starts[c+1];i++)
+		{
+			if (norm(contours.points[i]-center) <= maxDist)
+				contours.points[pos++] = contours.points[i];
+		}
+		if (pos > start)
+			contours.starts[kept++] = start;
+	}
+	contours.points.resize(pos);
+	contours.starts.resize(kept);
+	contours.starts.push_back(pos);
+}
+
+// Number of point triplets sampled per batch when voting for centers. Each batch
+// has its own random sequence, so results do not depend on the threads used
+static const int CENTER_BATCH_SIZE = 256;
+
+// Number of batches voted between checks of whether one center clearly dominates
+static const int CENTER_BATCHES_PER_ROUND = 8;
+
+// Size of the cells used to compare the best center with the runner-up, at maxSize
+static const int CENTER_CELL_SIZE = 16;
+
+/*
+ * Votes for circle centers with batches of random point triplets.
+ * The votes of each batch are the indices of the pixels voted for.
+ */
+class CenterVoteBody : public ParallelLoopBody
+{
+public:
+	CenterVoteBody(const ContourSet& contours, Size imgSize, 
+		double minDist, double minRadius, unsigned long long seed, int firstBatch, 
+		int iterations, vector<vector<int> >& votes) :
+		points(contours.points), starts(contours.starts), imgSize(imgSize), minDist(minDist), minRadius(minRadius),
+		seed(seed), firstBatch(firstBatch), iterations(iterations), votes(votes) {
+	}
+
+	void operator()(const Range& range) const {
+		for (int b=range.start;b<range.end;b++)
+			voteBatch(firstBatch + b, votes[b]);
+	}
+
+private:
+	void voteBatch(int batch, vector<int>& out) const {
+		out.clear();
+
+		int count = min(CENTER_BATCH_SIZE, iterations - batch * CENTER_BATCH_SIZE);
+		if (count <= 0)
+			return;
+
+		RNG rng(seed + (unsigned long long)(batch + 1) * 0x9E3779B97F4A7C15ULL);
+		int numContours = (int)starts.size() - 1;
+
+		// Pick three random points from a random contour
+		double ax[CENTER_BATCH_SIZE], ay[CENTER_BATCH_SIZE];
+		double bx[CENTER_BATCH_SIZE], by[CENTER_BATCH_SIZE];
+		double cx[CENTER_BATCH_SIZE], cy[CENTER_BATCH_SIZE];
+		for (int i=0;i<count;i++)
+		{
+			int ctr = rng.uniform(0, numContours);
+			int start = starts[ctr];
+			int len = starts[ctr + 1] - start;
+			const Point& a = points[start + rng.uniform(0, len)];
+			const Point& b = points[start + rng.uniform(0, len)];
+			const Point& c = points[start + rng.uniform(0, len)];
+			ax[i] = a.x; ay[i] = a.y;
+			bx[i] = b.x; by[i] = b.y;
+			cx[i] = c.x; cy[i] = c.y;
+		}
+
+		// Find circle through the points in closed form, without branches
+		double ux[CENTER_BATCH_SIZE], uy[CENTER_BATCH_SIZE];
+		unsigned char valid[CENTER_BATCH_SIZE];
+		double minDist2 = minDist * minDist;
+		double minRadius2 = minRadius * minRadius;
+		for (int i=0;i<count;i++)
+		{
+			double abx = bx[i] - ax[i], aby = by[i] - ay[i];
+			double acx = cx[i] - ax[i], acy = cy[i] - ay[i];
+			double bcx = cx[i] - bx[i], bcy = cy[i] - by[i];
+
+			// Circumcenter relative to first point
+			double d = 2 * (abx * acy - aby * acx);
+			double ab2 = abx * abx + aby * aby;
+			double ac2 = acx * acx + acy * acy;
+			bool ok = (ab2 >= minDist2) & (ac2 >= minDist2) & (bcx * bcx + bcy * bcy >= minDist2) & (fabs(d) > 1e-9);
+			double inv = 1.0 / (ok ? d : 1.0);
+			double rx = (acy * ab2 - aby * ac2) * inv;
+			double ry = (abx * ac2 - acx * ab2) * inv;
+			ux[i] = ax[i] + rx;
+			uy[i] = ay[i] + ry;
+
+			ok = ok & (rx * rx + ry * ry >= minRadius2) 
+				& (ux[i] >= 0) & (ux[i] < imgSize.width) & (uy[i] >= 0) & (uy[i] < imgSize.height);
+			valid[i] = ok;
+		}
+
+		for (int i=0;i<count;i++)
+		{
+			if (valid[i])
+				out.push_back((int)uy[i] * imgSize.width + (int)ux[i]);
+		}
+	}
+
+	const vector<Point>& points;
+	const vector<int>& starts;
+	Size imgSize;
+	double minDist;
+	double minRadius;
+	unsigned long long seed;
+	int firstBatch;
+	int iterations;
+	vector<vector<int> >& votes;
+};
+
+/*
+ * Checks if the cell with the most votes has clearly more than any cell 
+ * which is not next to it
+ */
+static bool centerDominates(const Mat& cellVotes)
+{
+	static int minVotes = 200;
+	static double minRatio = 4;
+
+	double maxVal;
+	Point maxLoc;
+	minMaxLoc(cellVotes, NULL, &maxVal, NULL, &maxLoc);
+	if (maxVal < minVotes)
+		return false;
+
+	int runnerUp = 0;
+	for (int y=0;y<cellVotes.rows;y++)
+	{
+		const int *row = cellVotes.ptr<int>(y);
+		for (int x=0;x<cellVotes.cols;x++)
+		{
+			if (abs(x - maxLoc.x) > 1 || abs(y - maxLoc.y) > 1)
+				runnerUp = max(runnerUp, row[x]);
+		}
+	}
+	return maxVal >= runnerUp * minRatio;
+}
+
 /*
  * Finds the most likely centerpoint of circles that are present in a set of contours.
  * It does this by randomly sampling sets of three points from each contour.
@@ -44,57 +277,72 @@ static Mat findEdges(Mat img)
  * The point that has the most number of increments is the most likely center.
  * This is done instead of HoughCircles as the Petri dish has multiple near-concentric
  * circles, which confuses the HoughCircles algorithm
+ *
+ * Sampling is done in seeded batches which can run on several threads. Voting
+ * stops early once one center clearly dominates.
+ *
+ * size is the size the image has been scaled to (maxSize, or less when finding
+ * the circle coarsely), which distances are relative to.
  */
-void findBestCenter(Size imgSize, vector<vector<Point> > contours, double& maxVal, Point& maxLoc, bool debug)
+static void findBestCenter(Size imgSize, const ContourSet& contours, double& maxVal, Point& maxLoc, 
+	int size, const CircleFinderParams& params, bool debug)
 {
 	static int iterations = 10000;
-	static int minDistStartEnd = 40;
-	static double minRadius = maxSize / 10;
+	double minDistStartEnd = 40.0 * size / maxSize;
+	double minRadius = size / 10;
+	int cellSize = max(CENTER_CELL_SIZE * size / maxSize, 4);
 
-	// Create array to total possible centers in
-	Mat centers(imgSize, CV_32F, Scalar(0.0));
+	// Create array to total possible centers in, and a coarse one to check dominance
+	Mat votes(imgSize, CV_32S, Scalar(0));
+	Mat cellVotes((imgSize.height + cellSize - 1) / cellSize, 
+		(imgSize.width + cellSize - 1) / cellSize, CV_32S, Scalar(0));
 
 	if (debug)
 		timeit("finding centers...");
 
+	ContextStage stage(params.context, "findBestCenter");
+
 	// Start finding circles
-	for (int iter=0;iter<iterations;iter++)
+	int numBatches = (iterations + CENTER_BATCH_SIZE - 1) / CENTER_BATCH_SIZE;
+	vector<vector<int> > batchVotes(CENTER_BATCHES_PER_ROUND);
+	int samples = 0, validVotes = 0;
+	for (int first=0;first<numBatches;first+=CENTER_BATCHES_PER_ROUND)
 	{
-		// Select random contour
-		int ctr = rand() % contours.size();
-
-		// Pick random start point
-		Point2d start = contours[ctr][rand() % contours[ctr].size()];
-
-		// Pick random end point
-		Point2d end = contours[ctr][rand() % contours[ctr].size()];
-
-		// If not far enough apart, skip
-		double dist = norm(start-end);
-		if (dist<minDistStartEnd)
-			continue;
-
-		// Pick random third point
-		Point2d third = contours[ctr][rand() % contours[ctr].size()];
-		if (norm(third-start)<minDistStartEnd)
-			continue;
-		if (norm(third-end)<minDistStartEnd)
-			continue;
+		int batches = min(CENTER_BATCHES_PER_ROUND, numBatches - first);
+		parallelForBands(batches, params.numThreads, CenterVoteBody(contours, imgSize, 
+			minDistStartEnd, minRadius, params.seed, first, iterations, batchVotes));
+		samples = min((first + batches) * CENTER_BATCH_SIZE, iterations);
+
+		// Add up votes in batch order
+		int *total = votes.ptr<int>(0);
+		for (int b=0;b<batches;b++)
+		{
+			for (int i=0;i<batchVotes[b].size();i++)
+			{
+				int index = batchVotes[b][i];
+				total[index]++;
+				cellVotes.at<int>((index / imgSize.width) / cellSize, 
+					(index % imgSize.width) / cellSize)++;
+			}
+			validVotes += batchVotes[b].size();
+		}
 
-		// Find circle of best fit
-		Circle circ(start, end, third);
-		if (circ.GetRadius() < minRadius)
-			continue;
+		if (centerDominates(cellVotes))
+			break;
+	}
 
-		// Put center on image to total where centers are
-		if (circ.GetCenter().inside(Rect(0,0,imgSize.width, imgSize.height)))
-			centers.at<float>(circ.GetCenter().y, circ.GetCenter().x)+=1.0;
+	if (params.context)
+	{
+		params.context->counter("center samples", samples);
+		params.context->counter("center votes", validVotes);
 	}
 
 	if (debug)
 		timeit("centers");
 
 	// Smooth centers
+	Mat centers;
+	votes.convertTo(centers, CV_32F);
 	GaussianBlur(centers, centers, Size(9, 9), 1, 1);
 
 	// Find best center
@@ -110,52 +358,65 @@ void findBestCenter(Size imgSize, vector<vector<Point> > contours, double& maxVa
 		line(centers, maxLoc-Point(20,0), maxLoc-Point(40,0), Scalar(1));
 
 		// Draw contours
-		drawContours(centers, contours, -1, Scalar(0.5));
+		for (int i=0;i<contours.points.size();i++)
+			centers.at<float>(contours.points[i]) = 0.5;
 		imshow("centers", centers);
 	}
 }
 
 /*
- * Finds the circle of the Petri dish within an image.
+ * Finds the circle of the Petri dish within a grayscale image, after scaling it
+ * so that its largest side is size pixels.
  * It does so by iteratively finding the strongest circle, eliminating all contours outside of it
  * and then looking for any further circles within it, down to a minimum radius based on the
  * original circle.
+ * Returns the circle at the edge found, in the coordinates of the unscaled image,
+ * or a radius of 0 if none was found.
  */
-Vec3f findPetriDish(Mat img)
+static Vec3f findDishCircle(Mat gray, int size, int interpolation, const CircleFinderParams& params)
 {
+	ContextStage stage(params.context, "findDishCircle");
+
 	bool debug = false;							// True to display progress images
-	static int minContourSize = 120;			// Minimum size in pixels of a contour to be considered
-	static int minDistStartEnd = 30;			// Minimum distance between a start and end point of any two of the three points
-	static double minRadius = maxSize / 10;		// Minimum radius of the circle
-	int minContourPoints = 15;					// Minimum number of contour points in a contour
+	double sizeScale = size * 1.0 / maxSize;
+	int minContourSize = 120 * sizeScale;		// Minimum size in pixels of a contour to be considered
+	double minRadius = size / 10;				// Minimum radius of the circle
+	int minContourPoints = max(15 * sizeScale, 4.0);	// Minimum number of contour points in a contour
 	double minCenterVal = 1;					// Minimum accumulated center value
 
 	Point center(0,0);
 	double radius = 0;
 
-	// Convert to scaled grayscale image
-	Mat gray;
-	cvtColor(img, gray, CV_BGR2GRAY);
-
-	// Scale to 1024 size
-	double scaleby = max(gray.rows, gray.cols)*1.0/maxSize;
+	// Scale to size
+	double scaleby = max(gray.rows, gray.cols)*1.0/size;
 	Mat resized;
-	resize(gray, resized, Size(), 1.0/scaleby, 1.0/scaleby, INTER_CUBIC);
+	resize(gray, resized, Size(), 1.0/scaleby, 1.0/scaleby, interpolation);
 	gray = resized;
 
 	if (debug)
 		timeit(NULL);
 
 	// Find edges in the image
-	Mat edges = findEdges(gray);
+	Mat edges;
+	{
+		ContextStage stage(params.context, "findEdges");
+		edges = findEdges(gray);
+	}
 
 	if (debug)
 		timeit("resize and edges");
 
 	// Find contours
-	vector<vector<Point> > contours;
-	vector<Vec4i> hierarchy;
-	findContours(edges, contours, hierarchy, CV_RETR_LIST, CV_CHAIN_APPROX_NONE);
+	ContourSet contours;
+	{
+		ContextStage stage(params.context, "findContours");
+		findContourSet(edges, contours);
+	}
+	if (params.context)
+	{
+		params.context->counter("contours", contours.count());
+		params.context->counter("contour points", contours.points.size());
+	}
 
 	if (debug)
 		timeit("contours");
@@ -164,24 +425,17 @@ Vec3f findPetriDish(Mat img)
 
 	do {
 		// Remove small contours and contours with few points
-		vector<vector<Point> > contours2;
-		for (int c=0;c<contours.size();c++) {
-			Rect r = boundingRect(contours[c]);
-
-			if (r.width > minContourSize || r.height > minContourSize) {
-				if (contours[c].size() >= minContourPoints)
-					contours2.push_back(contours[c]);
-			}
-		}
-		contours=contours2;
+		removeSmallContours(contours, minContourSize, minContourPoints);
+		if (params.context)
+			params.context->counter("kept contours", contours.count());
 
-		if (contours.size() == 0)
+		if (contours.count() == 0)
 			break;
 
 		// Find best center
 		double maxVal;
 		Point maxLoc;
-		findBestCenter(edges.size(), contours, maxVal, maxLoc, debug);
+		findBestCenter(edges.size(), contours, maxVal, maxLoc, size, params, debug);
 
 		// If center is in sufficiently strong, exit
 		if (maxVal < minCenterVal)
@@ -190,14 +444,12 @@ Vec3f findPetriDish(Mat img)
 		// Ensure that points on at least 3 quadrants are present to prevent small arcs from causing errors
 		// Arcs that do not include at least three quadrants are likely to give erroneous centerpoints
 		bool quadrants[] = { false, false, false, false };
-		for (int c=0;c<contours.size();c++) {
-			for (int i=0;i<contours[c].size();i++) {
-				Point p = contours[c][i] - maxLoc;
-				if (p.x > 0)
-					quadrants[p.y > 0 ? 1 : 0] = true;
-				else
-					quadrants[p.y > 0 ? 3 : 2] = true;
-			}
+		for (int i=0;i<contours.points.size();i++) {
+			Point p = contours.points[i] - maxLoc;
+			if (p.x > 0)
+				quadrants[p.y > 0 ? 1 : 0] = true;
+			else
+				quadrants[p.y > 0 ? 3 : 2] = true;
 		}
 		int totalQuadrants = 0;
 		for (int i=0;i<4;i++) {
@@ -209,10 +461,8 @@ Vec3f findPetriDish(Mat img)
 
 		// Find distance for all contour points from center
 		Mat dist(gray.rows + gray.cols, 1, CV_32F, Scalar(0));
-		for (int c=0;c<contours.size();c++) {
-			for (int i=0;i<contours[c].size();i++) {
-				dist.at<float>(norm(contours[c][i]-maxLoc))+=1;
-			}
+		for (int i=0;i<contours.points.size();i++) {
+			dist.at<float>(norm(contours.points[i]-maxLoc))+=1;
 		}
 
 		// Find best radius
@@ -225,19 +475,7 @@ Vec3f findPetriDish(Mat img)
 		radius = bestRadIndex - 1;		// Move inside points
 
 		// Remove any contour points not well inside circle to get ready to look again
-		contours2.clear();
-		for (int c=0;c<contours.size();c++)
-		{
-			vector<Point> ctr;
-			for (int i=0;i<contours[c].size();i++)
-			{
-				if (norm(contours[c][i]-maxLoc) <= bestRadIndex - 4)
-					ctr.push_back(contours[c][i]);
-			}
-			if (ctr.size() > 0)
-				contours2.push_back(ctr);
-		}
-		contours=contours2;
+		removeOutsidePoints(contours, maxLoc, bestRadIndex - 4);
 
 		// If first iteration
 		if (firstIter)
@@ -250,9 +488,10 @@ Vec3f findPetriDish(Mat img)
 		{
 			timeit("circle found");
 
-			Mat img2 = img.clone();
+			Mat img2;
+			cvtColor(resized, img2, CV_GRAY2BGR);
 
-			circle(img2, maxLoc * scaleby, bestRadIndex * scaleby, Scalar(0,255,0), 2);
+			circle(img2, maxLoc, bestRadIndex, Scalar(0,255,0), 2);
 
 			namedWindow("circ", CV_GUI_EXPANDED);
 			imshow("circ", img2);
@@ -263,11 +502,248 @@ Vec3f findPetriDish(Mat img)
 		firstIter = false;
 	} while (true);
 
+	return Vec3f(center.x * scaleby, center.y * scaleby, radius * scaleby);
+}
+
+/*
+ * Fits a circle to a set of points by least squares (Kasa's method).
+ * Returns false if the points do not determine a circle.
+ */
+static bool fitCircle(const vector<Point2d>& points, Point2d& center, double& radius)
+{
+	if (points.size() < 3)
+		return false;
+
+	// Work relative to the mean for numerical stability
+	Point2d mean(0, 0);
+	for (int i=0;i<points.size();i++)
+		mean = mean + points[i];
+	mean = mean * (1.0 / points.size());
+
+	// Normal equations of x^2 + y^2 + A x + B y + C = 0
+	double sxx = 0, sxy = 0, syy = 0, sx = 0, sy = 0, sz = 0, sxz = 0, syz = 0;
+	for (int i=0;i<points.size();i++)
+	{
+		double x = points[i].x - mean.x, y = points[i].y - mean.y;
+		double z = x * x + y * y;
+		sxx += x * x; sxy += x * y; syy += y * y;
+		sx += x; sy += y; sz += z;
+		sxz += x * z; syz += y * z;
+	}
+	double n = points.size();
+	double m[3][4] = {
+		{ sxx, sxy, sx, -sxz },
+		{ sxy, syy, sy, -syz },
+		{ sx, sy, n, -sz }
+	};
+
+	// Solve by Gaussian elimination with partial pivoting
+	for (int col=0;col<3;col++)
+	{
+		int pivot = col;
+		for (int row=col+1;row<3;row++)
+		{
+			if (fabs(m[row][col]) > fabs(m[pivot][col]))
+				pivot = row;
+		}
+		if (fabs(m[pivot][col]) < 1e-12)
+			return false;
+		for (int k=0;k<4;k++)
+			swap(m[col][k], m[pivot][k]);
+		for (int row=0;row<3;row++)
+		{
+			if (row == col)
+				continue;
+			double f = m[row][col] / m[col][col];
+			for (int k=col;k<4;k++)
+				m[row][k] -= f * m[col][k];
+		}
+	}
+	double A = m[0][3] / m[0][0], B = m[1][3] / m[1][1], C = m[2][3] / m[2][2];
+
+	double r2 = (A * A + B * B) / 4 - C;
+	if (r2 <= 0)
+		return false;
+
+	center = Point2d(mean.x - A / 2, mean.y - B / 2);
+	radius = sqrt(r2);
+	return true;
+}
+
+// Height at maxSize of the strips that the band around a coarse circle is searched
+// in, and the margin added around each part of a strip so that blurring (4 pixels)
+// and Canny (2 pixels) see past its edges
+static const int REFINE_STRIP_HEIGHT = 32;
+static const int REFINE_MARGIN = 6;
+
+/*
+ * Refines a circle found on a coarse image by fitting the edge points within a narrow 
+ * band around it, at the resolution of maxSize. The band is covered by horizontal
+ * strips, and only the parts of each strip which the band crosses are scaled and 
+ * searched for edges, so most of the dish is never looked at.
+ * Returns the refined circle, or a radius of 0 if it could not be refined.
+ */
+static Vec3f refineDishCircle(Mat gray, Vec3f coarse, double band, OpenCVActivityContext *context)
+{
+	static int minPoints = 50;		// Minimum number of edge points to fit
+
+	double scaleby = max(gray.rows, gray.cols)*1.0/maxSize;
+	int interpolation = scaleby > 1 ? INTER_AREA : INTER_CUBIC;
+
+	// Circle and band in pixels at maxSize
+	Point2d c(coarse[0] / scaleby, coarse[1] / scaleby);
+	double r = coarse[2] / scaleby;
+	double inner = max(r - band, 0.0), outer = r + band;
+	Rect bounds(0, 0, cvFloor(gray.cols / scaleby), cvFloor(gray.rows / scaleby));
+
+	// Gather edge points within the band, with their distance from the coarse center
+	vector<Point2d> points;
+	vector<double> dists;
+	double searched = 0;
+	for (int sy0=max(cvFloor(c.y - outer), 0);sy0<min(cvCeil(c.y + outer) + 1, bounds.height);sy0+=REFINE_STRIP_HEIGHT)
+	{
+		int sy1 = min(sy0 + REFINE_STRIP_HEIGHT, bounds.height);
+
+		// Nearest and furthest rows of the strip from the center
+		double nearDy = c.y < sy0 ? sy0 - c.y : c.y > sy1 - 1 ? c.y - (sy1 - 1) : 0;
+		double farDy = max(fabs(sy0 - c.y), fabs(sy1 - 1 - c.y));
+		if (nearDy > outer)
+			continue;
+
+		// The band crosses the strip within outerX of the center, except within
+		// innerX of it where every row is inside the band
+		double outerX = sqrt(outer * outer - nearDy * nearDy);
+		double innerX = farDy < inner ? sqrt(inner * inner - farDy * farDy) : 0;
+		int spans[2][2] = {
+			{ cvFloor(c.x - outerX), cvCeil(c.x - innerX) + 1 },
+			{ cvFloor(c.x + innerX), cvCeil(c.x + outerX) + 1 }
+		};
+		int numSpans = 2;
+		if (spans[0][1] >= spans[1][0])
+		{
+			spans[0][1] = spans[1][1];
+			numSpans = 1;
+		}
+
+		for (int s=0;s<numSpans;s++)
+		{
+			int sx0 = max(spans[s][0], 0), sx1 = min(spans[s][1], bounds.width);
+			if (sx0 >= sx1)
+				continue;
+
+			// Scale the part of the image under the span and its margin, and find its edges
+			Rect part = Rect(sx0 - REFINE_MARGIN, sy0 - REFINE_MARGIN, 
+				sx1 - sx0 + 2 * REFINE_MARGIN, sy1 - sy0 + 2 * REFINE_MARGIN) & bounds;
+			Rect source = Rect(cvFloor(part.x * scaleby), cvFloor(part.y * scaleby),
+				cvCeil(part.width * scaleby), cvCeil(part.height * scaleby)) & Rect(0, 0, gray.cols, gray.rows);
+			Mat region;
+			resize(gray(source), region, part.size(), 0, 0, interpolation);
+			Mat edges = findEdges(region);
+			searched += part.area();
+
+			// Position at maxSize of each pixel of the part, from the source pixels it covers
+			double fx = source.width * 1.0 / part.width, fy = source.height * 1.0 / part.height;
+			for (int y=sy0-part.y;y<sy1-part.y;y++)
+			{
+				const unsigned char *row = edges.ptr<unsigned char>(y);
+				double py = (source.y + (y + 0.5) * fy - 0.5) / scaleby;
+				for (int x=sx0-part.x;x<sx1-part.x;x++)
+				{
+					if (!row[x])
+						continue;
+					Point2d p((source.x + (x + 0.5) * fx - 0.5) / scaleby, py);
+					double d = norm(p - c);
+					if (fabs(d - r) <= band)
+					{
+						points.push_back(p);
+						dists.push_back(d);
+					}
+				}
+			}
+		}
+	}
+	if (context)
+		context->counter("refine pixels", searched);
+	if (points.size() < minPoints)
+		return Vec3f(0, 0, 0);
+
+	// Find the strongest edge within the band, as findDishCircle does
+	int bins = cvCeil(band * 2) + 1;
+	Mat hist(bins, 1, CV_32F, Scalar(0));
+	for (int i=0;i<dists.size();i++)
+		hist.at<float>(cvRound(dists[i] - (r - band))) += 1;
+	GaussianBlur(hist, hist, Size(1, 3), 0, 1);
+	int peak;
+	minMaxIdx(hist, NULL, NULL, NULL, &peak);
+	double peakRadius = r - band + peak;
+
+	// Fit the points of that edge, then refit without outliers
+	vector<Point2d> edgePoints;
+	for (int i=0;i<points.size();i++)
+	{
+		if (fabs(dists[i] - peakRadius) <= 2)
+			edgePoints.push_back(points[i]);
+	}
+	Point2d center;
+	double radius;
+	for (int pass=0;pass<2;pass++)
+	{
+		if (edgePoints.size() < minPoints || !fitCircle(edgePoints, center, radius))
+			return Vec3f(0, 0, 0);
+
+		vector<Point2d> inliers;
+		for (int i=0;i<edgePoints.size();i++)
+		{
+			if (fabs(norm(edgePoints[i] - center) - radius) <= 1.5)
+				inliers.push_back(edgePoints[i]);
+		}
+		edgePoints.swap(inliers);
+	}
+
+	// Refinement should not move far from the coarse circle
+	if (norm(center - c) > band || fabs(radius - r) > band)
+		return Vec3f(0, 0, 0);
+
+	radius -= 1;		// Move inside points
+
+	return Vec3f(center.x * scaleby, center.y * scaleby, radius * scaleby);
+}
+
+/*
+ * Finds the circle of the Petri dish within an image.
+ * Normally searches the image scaled to maxSize. With params.coarseToFine, first
+ * searches a coarseSize thumbnail and then refines the circle in a narrow band
+ * at the resolution of maxSize, falling back to the full search if that fails.
+ */
+Vec3f findPetriDish(Mat img, const CircleFinderParams& params)
+{
+	ContextStage stage(params.context, "findPetriDish");
+
+	// Convert to grayscale image
+	Mat gray;
+	cvtColor(img, gray, CV_BGR2GRAY);
+
+	Vec3f circ(0, 0, 0);
+	if (params.coarseToFine)
+	{
+		Vec3f coarse = findDishCircle(gray, params.coarseSize, INTER_AREA, params);
+		if (coarse[2] > 0)
+		{
+			// Search within a few coarse pixels of the coarse circle
+			ContextStage stage(params.context, "refineDishCircle");
+			double band = 3.0 * maxSize / params.coarseSize + 2;
+			circ = refineDishCircle(gray, coarse, band, params.context);
+		}
+	}
+
+	if (circ[2] == 0)
+		circ = findDishCircle(gray, maxSize, INTER_CUBIC, params);
+
 	// Move inside outer edge to avoid edge effects
-	radius *= 0.975;
+	circ[2] *= 0.975;
 
 	// Return circle
-	return Vec3f(center.x * scaleby, center.y * scaleby, radius * scaleby);
+	return circ;
 }
 
 /*
@@ -1,7 +1,58 @@
+#pragma once
 
+class OpenCVActivityContext;
+
+/*
+ * Settings for finding the Petri dish. The defaults are used when none are given.
+ */
+struct CircleFinderParams
+{
+	CircleFinderParams();
+
+	// Seed for sampling points when voting for circle centers. The same seed
+	// always gives the same circle
+	unsigned long long seed;
+
+	// Number of threads to vote with. 1 (default) is single-threaded and 0
+	// uses all cores. Results do not depend on the number of threads
+	int numThreads;
+
+	// Find the circle on a small thumbnail first, then refine it at full detection
+	// resolution using only the edges in a narrow band around it
+	bool coarseToFine;
+
+	// Size of the largest side of the thumbnail used when coarseToFine is set
+	int coarseSize;
+
+	// Context to record stages and counters on, if any
+	OpenCVActivityContext *context;
+};
+
+// Size of the largest side of the image that findPetriDish searches. Larger
+// images are scaled down to it, so they need not be decoded at more than this
+const int PETRI_SEARCH_SIZE = 1024;
+
+/*
+ * Points of a set of contours, stored in one array so that they can be
+ * filtered in place and walked without following a pointer per contour. 
+ * Contour c is points [starts[c], starts[c+1]).
+ */
+struct ContourSet
+{
+	std::vector<cv::Point> points;
+	std::vector<int> starts;
+
+	int count() const { return (int)starts.size() - 1; }
+};
+
+// Contour handling of the circle finder. See CircleFinder.cpp
+void findContourSet(cv::Mat edges, ContourSet& contours);
+void removeSmallContours(ContourSet& contours, int minSize, int minPoints);
+void removeOutsidePoints(ContourSet& contours, cv::Point center, double maxDist);
 
 cv::Vec3f findPetriDish_Old(cv::Mat img);
-cv::Vec3f findPetriDish(cv::Mat img);
-cv::Rect findPetriRect(cv::Mat img);
+cv::Vec3f findPetriDish(cv::Mat img, const CircleFinderParams& params = CircleFinderParams());
+cv::Rect findPetriRect(cv::Mat img, const CircleFinderParams& params = CircleFinderParams());
+cv::Rect petriRectFromCircle(cv::Vec3f circ);
 
 bool testCirclePerformance(cv::Vec3f circ, cv::Mat refImg);
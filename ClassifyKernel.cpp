@@ -0,0 +1,352 @@
+#include "stdafx.h"
+#include <math.h>
+#include "ClassifyKernel.h"
+
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+/*
+ * Computes the SVM inputs of a single pixel. Must match convertColor
+ */
+static inline void colorFeatures(int b, int g, int r, float& lightness, float& redBlue)
+{
+	lightness = ((float)b + (float)g + (float)r)/600;
+	if (lightness > 1)
+		lightness = 1;
+
+	if (b + r == 0)
+		redBlue = 0.5f;
+	else
+		redBlue = (float)r/(float)(b + r);
+}
+
+/*
+ * Computes the lookup index of a single pixel. Must match classifyValues
+ */
+static inline int lookupIndex(int b, int g, int r, const int *svmQuants)
+{
+	float vals[2];
+	colorFeatures(b, g, r, vals[0], vals[1]);
+	int index = (int)roundf(vals[1]*(svmQuants[1]-1));
+	index *= svmQuants[0];
+	index += (int)roundf(vals[0]*(svmQuants[0]-1));
+	return index;
+}
+
+#ifdef __SSE4_1__
+
+/*
+ * Splits 16 interleaved BGR pixels (48 bytes) into blue, green and red
+ */
+static inline void deinterleaveBGR(const unsigned char *bgr, __m128i& b, __m128i& g, __m128i& r)
+{
+	__m128i a0 = _mm_loadu_si128((const __m128i*)bgr);
+	__m128i a1 = _mm_loadu_si128((const __m128i*)(bgr + 16));
+	__m128i a2 = _mm_loadu_si128((const __m128i*)(bgr + 32));
+
+	b = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(a0, _mm_setr_epi8(0,3,6,9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1)),
+		_mm_shuffle_epi8(a1, _mm_setr_epi8(-1,-1,-1,-1,-1,-1,2,5,8,11,14,-1,-1,-1,-1,-1))),
+		_mm_shuffle_epi8(a2, _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,1,4,7,10,13)));
+	g = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(a0, _mm_setr_epi8(1,4,7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1)),
+		_mm_shuffle_epi8(a1, _mm_setr_epi8(-1,-1,-1,-1,-1,0,3,6,9,12,15,-1,-1,-1,-1,-1))),
+		_mm_shuffle_epi8(a2, _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,2,5,8,11,14)));
+	r = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(a0, _mm_setr_epi8(2,5,8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1)),
+		_mm_shuffle_epi8(a1, _mm_setr_epi8(-1,-1,-1,-1,-1,1,4,7,10,13,-1,-1,-1,-1,-1,-1))),
+		_mm_shuffle_epi8(a2, _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,0,3,6,9,12,15)));
+}
+
+/*
+ * Computes the SVM inputs of 4 pixels whose channels are in the low 4 bytes
+ * of b, g and r
+ */
+static inline void colorFeatures4(__m128i b8, __m128i g8, __m128i r8, __m128& lightness, __m128& redBlue)
+{
+	__m128i bi = _mm_cvtepu8_epi32(b8);
+	__m128i ri = _mm_cvtepu8_epi32(r8);
+	__m128 bf = _mm_cvtepi32_ps(bi);
+	__m128 gf = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(g8));
+	__m128 rf = _mm_cvtepi32_ps(ri);
+
+	// Channel sums are exact in float, so the division rounds as in colorFeatures
+	lightness = _mm_div_ps(_mm_add_ps(_mm_add_ps(bf, gf), rf), _mm_set1_ps(600.0f));
+	lightness = _mm_min_ps(lightness, _mm_set1_ps(1.0f));
+
+	__m128i sumBR = _mm_add_epi32(bi, ri);
+	__m128 zero = _mm_castsi128_ps(_mm_cmpeq_epi32(sumBR, _mm_setzero_si128()));
+	__m128 denom = _mm_cvtepi32_ps(_mm_max_epi32(sumBR, _mm_set1_epi32(1)));
+	redBlue = _mm_blendv_ps(_mm_div_ps(rf, denom), _mm_set1_ps(0.5f), zero);
+}
+
+/*
+ * Rounds positive values to the nearest integer, with halves rounded up
+ * as roundf does
+ */
+static inline __m128i roundHalfUp(__m128 v)
+{
+	__m128i t = _mm_cvttps_epi32(v);
+	__m128 frac = _mm_sub_ps(v, _mm_cvtepi32_ps(t));
+	__m128i up = _mm_castps_si128(_mm_cmpge_ps(frac, _mm_set1_ps(0.5f)));
+	return _mm_sub_epi32(t, up);
+}
+
+#endif
+
+/*
+ * Normalizes a single channel value. Must match normalize8
+ */
+static inline unsigned char normalizeValue(int src, int background)
+{
+	if (background == 0)
+		return 0;
+
+	// Round half up
+	int val = (src * 400 + background) / (background * 2);
+	return val > 255 ? 255 : val;
+}
+
+#ifdef __SSE4_1__
+
+// floor(65536 / b) (65535 for 1) for each background value b, so that 200 * src / b
+// is found with a 16-bit multiply
+static unsigned short normalizeReciprocals[256];
+
+static struct NormalizeReciprocalsInit {
+	NormalizeReciprocalsInit() {
+		normalizeReciprocals[0] = 0;
+		normalizeReciprocals[1] = 65535;
+		for (int b=2;b<256;b++)
+			normalizeReciprocals[b] = 65536 / b;
+	}
+} normalizeReciprocalsInit;
+
+/*
+ * Normalizes 8 channel values widened to 16 bits whose backgrounds are not 0,
+ * as normalizeValue does. rcp holds the normalizeReciprocals of the backgrounds
+ */
+static inline __m128i normalize8(__m128i src, __m128i background, __m128i rcp)
+{
+	// The quotient of 200 * src (at most 51000) by the reciprocal is at most one
+	// too small, which the remainder corrects
+	__m128i t = _mm_mullo_epi16(src, _mm_set1_epi16(200));
+	__m128i q = _mm_mulhi_epu16(t, rcp);
+	__m128i r = _mm_sub_epi16(t, _mm_mullo_epi16(q, background));
+	__m128i over = _mm_cmpeq_epi16(_mm_max_epu16(r, background), r);
+	q = _mm_sub_epi16(q, over);
+	r = _mm_sub_epi16(r, _mm_and_si128(over, background));
+
+	// Round half up: add one if the remainder is at least half the background
+	__m128i r2 = _mm_add_epi16(r, r);
+	q = _mm_sub_epi16(q, _mm_cmpeq_epi16(_mm_max_epu16(r2, background), r2));
+	return _mm_min_epu16(q, _mm_set1_epi16(255));
+}
+
+/*
+ * Gets the normalizeReciprocals of 8 background values
+ */
+static inline __m128i loadReciprocals(const unsigned char *b)
+{
+	const unsigned short *rcp = normalizeReciprocals;
+	return _mm_setr_epi16(rcp[b[0]], rcp[b[1]], rcp[b[2]], rcp[b[3]], 
+		rcp[b[4]], rcp[b[5]], rcp[b[6]], rcp[b[7]]);
+}
+
+#endif
+
+void normalizeRow(const unsigned char *src, const unsigned char *background, 
+	const unsigned char *mask, unsigned char *dst, int n)
+{
+	int i = 0;
+#ifdef __SSE4_1__
+	// Pixel of each byte of the three 16 byte blocks of 16 BGR pixels, to spread the mask
+	const __m128i pixelOf[3] = {
+		_mm_setr_epi8(0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5),
+		_mm_setr_epi8(5,5,6,6,6,7,7,7,8,8,8,9,9,9,10,10),
+		_mm_setr_epi8(10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15)
+	};
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i outsideValue = _mm_set1_epi8((char)200);
+	for (;i<=n-16;i+=16)
+	{
+		__m128i inside = _mm_loadu_si128((const __m128i*)(mask + i));
+		for (int c=0;c<3;c++)
+		{
+			int k = i*3 + c*16;
+			__m128i s = _mm_loadu_si128((const __m128i*)(src + k));
+			__m128i b = _mm_loadu_si128((const __m128i*)(background + k));
+			__m128i lo = normalize8(_mm_cvtepu8_epi16(s), _mm_cvtepu8_epi16(b), loadReciprocals(background + k));
+			__m128i hi = normalize8(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(b, zero), 
+				loadReciprocals(background + k + 8));
+			__m128i v = _mm_packus_epi16(lo, hi);
+
+			// 0 where the background is 0, and 200 outside of the mask
+			v = _mm_andnot_si128(_mm_cmpeq_epi8(b, zero), v);
+			__m128i outside = _mm_cmpeq_epi8(_mm_shuffle_epi8(inside, pixelOf[c]), zero);
+			_mm_storeu_si128((__m128i*)(dst + k), _mm_blendv_epi8(v, outsideValue, outside));
+		}
+	}
+#endif
+	for (;i<n;i++)
+	{
+		for (int c=0;c<3;c++)
+		{
+			int k = i*3 + c;
+			dst[k] = mask[i] ? normalizeValue(src[k], background[k]) : 200;
+		}
+	}
+}
+
+void computeColorFeatures(const unsigned char *bgr, float *lightness, float *redBlue, int n)
+{
+	int i = 0;
+#ifdef __SSE4_1__
+	for (;i<=n-16;i+=16)
+	{
+		__m128i b, g, r;
+		deinterleaveBGR(bgr + i*3, b, g, r);
+		for (int k=0;k<4;k++)
+		{
+			__m128 l, rb;
+			colorFeatures4(b, g, r, l, rb);
+			_mm_storeu_ps(lightness + i + k*4, l);
+			_mm_storeu_ps(redBlue + i + k*4, rb);
+			b = _mm_srli_si128(b, 4);
+			g = _mm_srli_si128(g, 4);
+			r = _mm_srli_si128(r, 4);
+		}
+	}
+#endif
+	for (;i<n;i++)
+		colorFeatures(bgr[i*3], bgr[i*3+1], bgr[i*3+2], lightness[i], redBlue[i]);
+}
+
+void computeLookupIndices(const unsigned char *bgr, int *indices, int n, const int *svmQuants)
+{
+	int i = 0;
+#ifdef __SSE4_1__
+	__m128 scale0 = _mm_set1_ps((float)(svmQuants[0]-1));
+	__m128 scale1 = _mm_set1_ps((float)(svmQuants[1]-1));
+	__m128i stride = _mm_set1_epi32(svmQuants[0]);
+	for (;i<=n-16;i+=16)
+	{
+		__m128i b, g, r;
+		deinterleaveBGR(bgr + i*3, b, g, r);
+		for (int k=0;k<4;k++)
+		{
+			__m128 l, rb;
+			colorFeatures4(b, g, r, l, rb);
+			__m128i q0 = roundHalfUp(_mm_mul_ps(l, scale0));
+			__m128i q1 = roundHalfUp(_mm_mul_ps(rb, scale1));
+			_mm_storeu_si128((__m128i*)(indices + i + k*4), _mm_add_epi32(_mm_mullo_epi32(q1, stride), q0));
+			b = _mm_srli_si128(b, 4);
+			g = _mm_srli_si128(g, 4);
+			r = _mm_srli_si128(r, 4);
+		}
+	}
+#endif
+	for (;i<n;i++)
+		indices[i] = lookupIndex(bgr[i*3], bgr[i*3+1], bgr[i*3+2], svmQuants);
+}
+
+void classifyLookupRow(const unsigned char *bgr, unsigned char *classes, int n,
+	const unsigned char *svmLookup, const int *svmQuants)
+{
+	// Work in blocks so the indices stay in L1
+	const int blockSize = 256;
+	int indices[blockSize];
+
+	for (int i=0;i<n;i+=blockSize)
+	{
+		int cnt = n - i < blockSize ? n - i : blockSize;
+		computeLookupIndices(bgr + i*3, indices, cnt, svmQuants);
+		for (int k=0;k<cnt;k++)
+			classes[i+k] = svmLookup[indices[k]];
+	}
+}
+
+int classifyLinear(float lightness, float redBlue, const LinearPlane *planes, int numPlanes, int numClasses)
+{
+	double l = lightness, rb = redBlue;
+	int votes[MAX_LINEAR_CLASSES] = { 0 };
+	for (int p=0;p<numPlanes;p++)
+	{
+		double d = planes[p].w[0] * l + planes[p].w[1] * rb + planes[p].b;
+		votes[d > 0 ? planes[p].first : planes[p].second]++;
+	}
+
+	int best = 0;
+	for (int c=1;c<numClasses;c++)
+	{
+		if (votes[c] > votes[best])
+			best = c;
+	}
+	return best;
+}
+
+void classifyLinearRow(const unsigned char *bgr, unsigned char *classes, int n,
+	const LinearPlane *planes, int numPlanes, const unsigned char *labels, int numClasses)
+{
+	// Work in blocks so the features stay in L1
+	const int blockSize = 256;
+	float lightness[blockSize], redBlue[blockSize];
+
+	for (int i=0;i<n;i+=blockSize)
+	{
+		int cnt = n - i < blockSize ? n - i : blockSize;
+		computeColorFeatures(bgr + i*3, lightness, redBlue, cnt);
+
+		int k = 0;
+#ifdef __SSE4_1__
+		// Planes are evaluated in double precision, 4 pixels at a time as two pairs,
+		// with the same operations as classifyLinear
+		const __m128d zero = _mm_setzero_pd();
+		const __m128i one = _mm_set1_epi32(1);
+		for (;k<=cnt-4;k+=4)
+		{
+			__m128 l = _mm_loadu_ps(lightness + k);
+			__m128 rb = _mm_loadu_ps(redBlue + k);
+			__m128d l0 = _mm_cvtps_pd(l), l1 = _mm_cvtps_pd(_mm_movehl_ps(l, l));
+			__m128d rb0 = _mm_cvtps_pd(rb), rb1 = _mm_cvtps_pd(_mm_movehl_ps(rb, rb));
+
+			__m128i votes[MAX_LINEAR_CLASSES];
+			for (int c=0;c<numClasses;c++)
+				votes[c] = _mm_setzero_si128();
+
+			for (int p=0;p<numPlanes;p++)
+			{
+				__m128d w0 = _mm_set1_pd(planes[p].w[0]);
+				__m128d w1 = _mm_set1_pd(planes[p].w[1]);
+				__m128d b = _mm_set1_pd(planes[p].b);
+				__m128d d0 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(w0, l0), _mm_mul_pd(w1, rb0)), b);
+				__m128d d1 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(w0, l1), _mm_mul_pd(w1, rb1)), b);
+
+				// All ones where the vote goes to first
+				__m128i isFirst = _mm_castps_si128(_mm_shuffle_ps(_mm_castpd_ps(_mm_cmpgt_pd(d0, zero)),
+					_mm_castpd_ps(_mm_cmpgt_pd(d1, zero)), _MM_SHUFFLE(2,0,2,0)));
+				votes[planes[p].first] = _mm_sub_epi32(votes[planes[p].first], isFirst);
+				votes[planes[p].second] = _mm_add_epi32(votes[planes[p].second], _mm_add_epi32(one, isFirst));
+			}
+
+			// Keep the first class with the most votes
+			__m128i best = _mm_setzero_si128();
+			__m128i bestVotes = votes[0];
+			for (int c=1;c<numClasses;c++)
+			{
+				__m128i more = _mm_cmpgt_epi32(votes[c], bestVotes);
+				best = _mm_blendv_epi8(best, _mm_set1_epi32(c), more);
+				bestVotes = _mm_max_epi32(bestVotes, votes[c]);
+			}
+
+			int bestClass[4];
+			_mm_storeu_si128((__m128i*)bestClass, best);
+			for (int j=0;j<4;j++)
+				classes[i+k+j] = labels[bestClass[j]];
+		}
+#endif
+		for (;k<cnt;k++)
+			classes[i+k] = labels[classifyLinear(lightness[k], redBlue[k], planes, numPlanes, numClasses)];
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * Row kernels for preprocessing and classifying pixels. These work on raw
+ * rows of BGR pixels so that images are walked in memory order, and use
+ * SSE4.1 when the compiler has it enabled (-msse4.1). Classification results are identical
+ * to the scalar convertColor/classifyValues path in ColonyCounter.cpp.
+ */
+
+// Normalizes n BGR pixels against their background so that the background 
+// becomes 200: round(200 * src / background) for each channel, or 0 where the
+// background is 0. Pixels outside of the mask (mask zero) are set to 200.
+void normalizeRow(const unsigned char *src, const unsigned char *background, 
+	const unsigned char *mask, unsigned char *dst, int n);
+
+// Computes the SVM inputs of n BGR pixels: lightness (sum of channels / 600,
+// at most 1) and red vs blue (red / (red + blue), 0.5 if both are zero)
+void computeColorFeatures(const unsigned char *bgr, float *lightness, float *redBlue, int n);
+
+// Computes the index into a 2-dimensional SVM lookup table for n BGR pixels,
+// rounding each input to the nearest step of the quantization.
+void computeLookupIndices(const unsigned char *bgr, int *indices, int n, const int *svmQuants);
+
+// Classifies n BGR pixels using a 2-dimensional SVM lookup table
+void classifyLookupRow(const unsigned char *bgr, unsigned char *classes, int n,
+	const unsigned char *svmLookup, const int *svmQuants);
+
+// Most classes supported by classifyLinearRow
+const int MAX_LINEAR_CLASSES = 8;
+
+// Decision between two classes of a one-vs-one linear SVM. A pixel votes for 
+// first if w[0] * lightness + w[1] * redBlue + b > 0, and otherwise for second
+struct LinearPlane
+{
+	double w[2];
+	double b;
+	int first;
+	int second;
+};
+
+// Classifies n BGR pixels by voting over the planes of a linear SVM between
+// numClasses classes as CvSVM does: the class with the most votes wins, the
+// first one on ties. labels gives the value written for each class.
+void classifyLinearRow(const unsigned char *bgr, unsigned char *classes, int n,
+	const LinearPlane *planes, int numPlanes, const unsigned char *labels, int numClasses);
+
+// Classifies a single pixel's SVM inputs as classifyLinearRow does, returning the class index
+int classifyLinear(float lightness, float redBlue, const LinearPlane *planes, int numPlanes, int numClasses);
@@ -1,6 +1,19 @@
 #include "stdafx.h"
 #include "ColonyCounter.h"
+#include "BitPlane.h"
 #include "CircleFinder.h"
+#include "ComponentLabeler.h"
+#include "ClassifyKernel.h"
+#include "MaskedMean.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace cv;
 
@@ -9,24 +22,59 @@ ColonyCounter::ColonyCounter(void)
 	trained = false;
 	svmLookup = NULL;
 	svmQuants = NULL;
+	modelMapping = NULL;
+	modelMappingSize = 0;
+	linearEnabled = true;
+	colorTableMode = COLOR_TABLE_NONE;
+	numThreads = 1;
+	backgroundScale = 1;
+	trainingPixels = trainingSamples = trainingRows = 0;
 }
 
 ColonyCounter::~ColonyCounter(void)
 {
+	unmapModel();
 }
 
 
+/*
+ * Sets the number of threads used by preprocessImage, classifyImage and
+ * countColonies. 1 (the default) runs everything on the calling thread
+ * and 0 uses all cores. Results do not depend on the number of threads.
+ */
+void ColonyCounter::setNumThreads(int numThreads)
+{
+	this->numThreads = numThreads;
+}
+
+/*
+ * Sets the scale at which the background is estimated during preprocessing.
+ * 1 (the default) works at full resolution. 4 or 8 estimates the background
+ * on an image reduced by that factor and then upsamples it, which is much
+ * faster. As the background window is two fifths of the plate, the result
+ * changes very little. See the test-background command.
+ */
+void ColonyCounter::setBackgroundScale(int scale)
+{
+	backgroundScale = max(scale, 1);
+}
+
 void ColonyCounter::loadTraining(const char *path) 
 {
+	unmapModel();
 	svm.load(path);
 	trained = true;
+	buildLinearClassifier();
+	buildColorTable(COLOR_TABLE_NONE);
 }
 
 void ColonyCounter::loadTrainingQuantized(unsigned char *svmLookup, int *svmQuants)
 {
+	unmapModel();
 	this->svmLookup = svmLookup;
 	this->svmQuants = svmQuants;
 	trained = true;
+	buildColorTable(COLOR_TABLE_NONE);
 }
 
 
@@ -36,19 +84,17 @@ void ColonyCounter::saveTraining(const char *path)
 }
 
 /*
- * Writes out a header file that contains a large array of SVM results
- * to look up, where both inputs must be between zero and one.
- *
- * svmQuants is quantization to use. e.g. quantization of 10 will produce
- * lookup values for 0, 0.1, 0.2, ... 0.9
+ * Writes a lookup table as a C header, for loadTrainingQuantized
  */
-void ColonyCounter::saveTrainingQuantized(const char *path, int *svmQuants)
+static bool writeTableHeader(const char *path, const int *svmQuants, int dim, const vector<unsigned char>& table)
 {
-	FILE *file;
-	file = fopen(path, "w");
+	FILE *file = fopen(path, "w");
+	if (!file)
+		return false;
+
 	fprintf(file, "// AUTOGENERATED FILE by ColonyCounter::saveTrainingQuantized\n");
 	fprintf(file, "static int svmQuants[] = { ");
-	for (int i=0;i<SVM_DIM;i++)
+	for (int i=0;i<dim;i++)
 	{
 		if (i>0)
 			fprintf(file, ",");
@@ -57,27 +103,281 @@ void ColonyCounter::saveTrainingQuantized(const char *path, int *svmQuants)
 	fprintf(file, "};\n");
 
 	fprintf(file, "static unsigned char svmLookup[] = { ");
-	int index = 0;
-	for (int q1=0;q1<svmQuants[1];q1++)
+
+	// Format a line of the table at a time, as large tables have millions of entries
+	int lineSize = svmQuants[0];
+	string line;
+	for (size_t start=0;start<table.size();start+=lineSize)
 	{
-		fprintf(file, "\n");
-		for (int q0=0;q0<svmQuants[0];q0++)
+		line = "\n";
+		for (int q0=0;q0<lineSize;q0++)
 		{
-			float vals[2];
-			vals[0] = q0 * 1.0 / svmQuants[0];
-			vals[1] = q1 * 1.0 / svmQuants[1];
-			int cls = classifyValues(vals);
-			fprintf(file, " %d", cls);
+			char entry[8];
+			sprintf(entry, " %d", table[start + q0]);
+			line += entry;
 
-			if (q0 != svmQuants[0] - 1 || q1 != svmQuants[1] - 1)
-				fprintf(file, ",", cls);
-			index++;
+			if (start + q0 != table.size() - 1)
+				line += ",";
 		}
+		fputs(line.c_str(), file);
 	}
 
 	fprintf(file, "};\n");
 
-	fclose(file);
+	return fclose(file) == 0;
+}
+
+/*
+ * Classifies a batch of SVM inputs, one row of samples each
+ */
+void ColonyCounter::classifyValuesBatch(const Mat& samples, unsigned char *classes)
+{
+	// The SVM itself is called once for the whole batch
+	if (!svmLookup && !(linearEnabled && !linearPlanes.empty()))
+	{
+		Mat responses;
+		svm.predict(samples, responses);
+		for (int i=0;i<samples.rows;i++)
+			classes[i] = (unsigned char)responses.at<float>(i);
+		return;
+	}
+
+	for (int i=0;i<samples.rows;i++)
+		classes[i] = classifyValues((float*)samples.ptr<float>(i));
+}
+
+/*
+ * Computes lines of a lookup table, each being all values of the first input
+ * for one combination of the others
+ */
+class QuantizedTableBody : public ParallelLoopBody
+{
+public:
+	QuantizedTableBody(ColonyCounter& colonyCounter, const int *svmQuants, vector<unsigned char>& table) :
+		colonyCounter(colonyCounter), svmQuants(svmQuants), table(table) {
+	}
+
+	void operator()(const Range& range) const {
+		const int dim = ColonyCounter::SVM_DIM;
+		Mat samples(svmQuants[0], dim, CV_32F);
+		for (int line=range.start;line<range.end;line++)
+		{
+			// Inputs other than the first are the same throughout the line
+			int q = line;
+			for (int d=1;d<dim;d++)
+			{
+				float val = (q % svmQuants[d]) * 1.0 / svmQuants[d];
+				samples.col(d).setTo(Scalar(val));
+				q /= svmQuants[d];
+			}
+			for (int q0=0;q0<svmQuants[0];q0++)
+				samples.at<float>(q0, 0) = q0 * 1.0 / svmQuants[0];
+
+			colonyCounter.classifyValuesBatch(samples, &table[(size_t)line * svmQuants[0]]);
+		}
+	}
+
+private:
+	ColonyCounter& colonyCounter;
+	const int *svmQuants;
+	vector<unsigned char>& table;
+};
+
+/*
+ * Computes the lookup table for a quantization. The first input varies
+ * fastest, as in classifyValues. Lines of the table are classified in
+ * batches on setNumThreads threads.
+ */
+void ColonyCounter::computeQuantizedTable(int *svmQuants, vector<unsigned char>& table)
+{
+	// A lookup table that is already loaded is kept exactly
+	if (svmLookup && this->svmQuants[0] == svmQuants[0] && this->svmQuants[1] == svmQuants[1])
+	{
+		table.assign(svmLookup, svmLookup + svmQuants[0] * svmQuants[1]);
+		return;
+	}
+
+	size_t tableSize = 1;
+	for (int d=0;d<SVM_DIM;d++)
+		tableSize *= svmQuants[d];
+	table.resize(tableSize);
+
+	int numLines = tableSize / svmQuants[0];
+	parallelForBands(numLines, numThreads, QuantizedTableBody(*this, svmQuants, table));
+}
+
+/*
+ * Binary model file. The header is followed by the lookup table, which is
+ * quants[0] * quants[1] bytes indexed as in classifyValues. All values are
+ * stored in the byte order of the machine which wrote the file, so a file
+ * written on a machine with the other byte order is rejected as having a bad version.
+ */
+struct ModelFileHeader
+{
+	char magic[8];				// MODEL_MAGIC
+	uint32_t version;			// MODEL_VERSION
+	uint32_t headerSize;		// Size of this header, where the table starts
+	uint32_t features;			// SVM inputs the table is indexed by, see MODEL_FEATURES_*
+	uint32_t quants[2];			// Quantization of each input
+	uint32_t tableSize;			// Size of the table in bytes
+	uint32_t checksum;			// FNV-1a hash of the table
+	uint32_t reserved;
+};
+
+static const char MODEL_MAGIC[8] = { 'E', 'C', 'P', 'M', 'O', 'D', 'E', 'L' };
+static const uint32_t MODEL_VERSION = 1;
+
+// Lightness (sum of channels / 600) and red vs blue (red / (red + blue)), as in convertColor
+static const uint32_t MODEL_FEATURES_LIGHTNESS_REDBLUE = 1;
+
+/*
+ * 32-bit FNV-1a hash
+ */
+static uint32_t fnv1a(const unsigned char *data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i=0;i<size;i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Writes a lookup table as a binary model file. The file is written next to path
+ * and renamed over it when complete, as processes may have the old file mapped
+ * (see loadTrainingBinary) and must keep seeing it whole until they reload.
+ */
+static bool writeTableBinary(const char *path, const int *svmQuants, const vector<unsigned char>& table)
+{
+	ModelFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+	header.version = MODEL_VERSION;
+	header.headerSize = sizeof(header);
+	header.features = MODEL_FEATURES_LIGHTNESS_REDBLUE;
+	header.quants[0] = svmQuants[0];
+	header.quants[1] = svmQuants[1];
+	header.tableSize = table.size();
+	header.checksum = fnv1a(&table[0], table.size());
+
+	string tempPath = string(path) + ".tmp";
+	FILE *file = fopen(tempPath.c_str(), "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(&table[0], 1, table.size(), file) == table.size()
+		&& fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = fclose(file) == 0 && ok;
+
+	if (!ok || rename(tempPath.c_str(), path) != 0)
+	{
+		unlink(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Writes the lookup table for a quantization of the current training to a
+ * binary model file, for loadTrainingBinary
+ */
+bool ColonyCounter::saveTrainingBinary(const char *path, int *svmQuants)
+{
+	vector<unsigned char> table;
+	computeQuantizedTable(svmQuants, table);
+	return writeTableBinary(path, svmQuants, table);
+}
+
+/*
+ * Writes out a header file that contains a large array of SVM results
+ * to look up, where both inputs must be between zero and one.
+ *
+ * svmQuants is quantization to use. e.g. quantization of 10 will produce
+ * lookup values for 0, 0.1, 0.2, ... 0.9
+ *
+ * If binaryPath is given, the same table is also written there as a binary
+ * model file (see saveTrainingBinary), so it is only computed once.
+ */
+bool ColonyCounter::saveTrainingQuantized(const char *path, int *svmQuants, const char *binaryPath)
+{
+	vector<unsigned char> table;
+	computeQuantizedTable(svmQuants, table);
+
+	bool ok = writeTableHeader(path, svmQuants, SVM_DIM, table);
+	if (binaryPath)
+		ok = writeTableBinary(binaryPath, svmQuants, table) && ok;
+	return ok;
+}
+
+/*
+ * Loads a binary model file written by saveTrainingBinary. The file is
+ * memory-mapped read-only and the table is used in place, so processes
+ * loading the same file share its pages. The header and checksum are
+ * checked before the model is used.
+ * To change the model at runtime, load the new file into a new ColonyCounter.
+ */
+bool ColonyCounter::loadTrainingBinary(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ModelFileHeader))
+		mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	// Check header and table
+	size_t size = st.st_size;
+	const ModelFileHeader *header = (const ModelFileHeader*)mapping;
+	const unsigned char *table = (const unsigned char*)mapping + header->headerSize;
+	bool valid = memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) == 0
+		&& header->version == MODEL_VERSION
+		&& header->headerSize >= sizeof(ModelFileHeader) && header->headerSize <= size
+		&& header->features == MODEL_FEATURES_LIGHTNESS_REDBLUE
+		&& header->quants[0] >= 2 && header->quants[0] <= 65536
+		&& header->quants[1] >= 2 && header->quants[1] <= 65536
+		&& header->tableSize == (uint64_t)header->quants[0] * header->quants[1]
+		&& header->tableSize <= size - header->headerSize
+		&& fnv1a(table, header->tableSize) == header->checksum;
+	if (!valid)
+	{
+		munmap(mapping, size);
+		return false;
+	}
+
+	unmapModel();
+	modelMapping = mapping;
+	modelMappingSize = size;
+	modelQuants[0] = header->quants[0];
+	modelQuants[1] = header->quants[1];
+
+	svmLookup = (unsigned char*)table;
+	svmQuants = modelQuants;
+	trained = true;
+	buildColorTable(COLOR_TABLE_NONE);
+	return true;
+}
+
+/*
+ * Releases the model file mapped by loadTrainingBinary, if any
+ */
+void ColonyCounter::unmapModel()
+{
+	if (!modelMapping)
+		return;
+
+	munmap(modelMapping, modelMappingSize);
+	modelMapping = NULL;
+	modelMappingSize = 0;
+	svmLookup = NULL;
+	svmQuants = NULL;
+	trained = false;
 }
 
 /*
@@ -105,8 +405,11 @@ void convertColor(Vec3b &color, float *vals)
 	if (vals[0] > 1)
 		vals[0] = 1;
 
-	// Get red vs blue
-	vals[1] = (float)color(2)/(float)(color(0) + color(2));
+	// Get red vs blue. Pixels with no red or blue at all are treated as neutral
+	if (color(0) + color(2) == 0)
+		vals[1] = 0.5f;
+	else
+		vals[1] = (float)color(2)/(float)(color(0) + color(2));
 
 	// Get green vs blue (removed to simplify SVM)
 	//vals[2] = (float)color(1)/(float)(color(0) + color(1));
@@ -129,93 +432,306 @@ int ColonyCounter::classifyValues(float* vals)
 		return svmLookup[index];
 	}
 
+	// Use hyperplanes of linear SVM if present
+	if (linearEnabled && !linearPlanes.empty())
+		return linearLabels[classifyLinear(vals[0], vals[1], &linearPlanes[0], linearPlanes.size(), linearLabels.size())];
+
 	Mat sampleMat = Mat(1, SVM_DIM, CV_32F, vals);
 	float response = svm.predict(sampleMat);
 	return response;
 }
 
 /*
- * Trains the classifier given a series of images and a matching
- * series of label images which are png files that have certain
- * parts of it marked with either red, cyan or green to indicate
- * total coliform, E. coli or background respectively.
+ * Gives access to the decision functions of a CvSVM, which are protected
  */
-void ColonyCounter::trainClassifier(vector<string> trainPaths, vector<string> labelPaths, int *quants)
+struct SVMInternals : public CvSVM
 {
-	// Count training data
-	int trainCnt = 0;
-	int trainByLabel[3] = { 0, 0, 0 };
+	static const CvSVMDecisionFunc* decisionFunctions(const CvSVM& svm) {
+		return svm.*(&SVMInternals::decision_func);
+	}
 
-	vector<Rect> petriRects;
+	static const CvMat* classLabels(const CvSVM& svm) {
+		return svm.*(&SVMInternals::class_labels);
+	}
+};
 
-	// Iterate through all images
-	for (int k=0;k<trainPaths.size();k++)
+/*
+ * With a linear kernel, each one-vs-one decision function of the SVM
+ *   sum(alpha[k] * dot(sv[k], x)) - rho
+ * is the hyperplane dot(w, x) - rho with w = sum(alpha[k] * sv[k]). Extracts
+ * these once so that pixels are classified without calling the SVM. Returns
+ * false, leaving the SVM to be called, if it is not a linear classifier of the 
+ * two inputs.
+ */
+bool ColonyCounter::buildLinearClassifier()
+{
+	linearPlanes.clear();
+	linearLabels.clear();
+
+	CvSVMParams params = svm.get_params();
+	const CvSVMDecisionFunc *df = SVMInternals::decisionFunctions(svm);
+	const CvMat *labels = SVMInternals::classLabels(svm);
+	if (params.svm_type != CvSVM::C_SVC || params.kernel_type != CvSVM::LINEAR 
+		|| svm.get_var_count() != SVM_DIM || !df || !labels)
+		return false;
+
+	int numClasses = labels->cols;
+	if (numClasses < 2 || numClasses > MAX_LINEAR_CLASSES)
+		return false;
+	for (int c=0;c<numClasses;c++)
 	{
-		// Extract rectangles
-		Mat img = imread(trainPaths[k]);
-		petriRects.push_back(findPetriRect(img));
+		if (labels->data.i[c] < 0 || labels->data.i[c] > 255)
+			return false;
+	}
 
-		// Load label image
-		Mat labelImg = imread(labelPaths[k]);
-		labelImg = labelImg(petriRects[k]);
+	// Decision functions are in the order of pairs (0,1), (0,2), ... (1,2), ...
+	vector<LinearPlane> planes;
+	for (int i=0;i<numClasses;i++)
+	{
+		for (int j=i+1;j<numClasses;j++, df++)
+		{
+			LinearPlane plane;
+			plane.w[0] = plane.w[1] = 0;
+			for (int k=0;k<df->sv_count;k++)
+			{
+				const float *sv = svm.get_support_vector(df->sv_index ? df->sv_index[k] : k);
+				plane.w[0] += df->alpha[k] * sv[0];
+				plane.w[1] += df->alpha[k] * sv[1];
+			}
+			plane.b = -df->rho;
+			plane.first = i;
+			plane.second = j;
+			planes.push_back(plane);
+		}
+	}
+
+	linearPlanes.swap(planes);
+	for (int c=0;c<numClasses;c++)
+		linearLabels.push_back(labels->data.i[c]);
+	return true;
+}
+
+/*
+ * Enables or disables classifying with the hyperplanes of a linear SVM. When
+ * disabled, the SVM itself is called for each pixel, which is very slow.
+ */
+void ColonyCounter::setLinearClassifier(bool enabled)
+{
+	linearEnabled = enabled;
+}
+
+/*
+ * Builds a table that gives the class of every BGR color directly, so that
+ * convertColor and classifyValues do not need to run for each pixel.
+ *
+ * COLOR_TABLE_FULL has an entry for every 24-bit color and gives exactly the
+ * same result as classifying the color. COLOR_TABLE_565 keeps only the top
+ * 5/6/5 bits of blue/green/red and classifies the center of each cell.
+ *
+ * The table is built from classifyValues, so building a full table from the
+ * SVM itself (rather than the quantized lookup) is slow.
+ */
+void ColonyCounter::buildColorTable(ColorTableMode mode)
+{
+	colorTableMode = COLOR_TABLE_NONE;
+	colorTable.clear();
+
+	if (mode == COLOR_TABLE_NONE)
+		return;
 
-		// Count training data
-		for (int x=0;x<labelImg.cols;x++)
+	assert(trained);
+
+	if (mode == COLOR_TABLE_FULL)
+	{
+		vector<unsigned char> table(1 << 24);
+		for (int r=0;r<256;r++)
 		{
-			for (int y=0;y<labelImg.rows;y++)
+			for (int g=0;g<256;g++)
 			{
-				Vec3b c = labelImg.at<Vec3b>(y, x);
-				int label = labelColorToIndex(c);
-				if (label >= 0)
+				for (int b=0;b<256;b++)
 				{
-					trainByLabel[label]++;
-					trainCnt++;
+					Vec3b color(b, g, r);
+					float vals[SVM_DIM];
+					convertColor(color, vals);
+					table[b | (g << 8) | (r << 16)] = classifyValues(vals);
 				}
 			}
 		}
+		colorTable.swap(table);
+	}
+	else
+	{
+		vector<unsigned char> table(1 << 16);
+		for (int r=0;r<32;r++)
+		{
+			for (int g=0;g<64;g++)
+			{
+				for (int b=0;b<32;b++)
+				{
+					// Use center of cell
+					Vec3b color((b << 3) | 4, (g << 2) | 2, (r << 3) | 4);
+					float vals[SVM_DIM];
+					convertColor(color, vals);
+					table[b | (g << 5) | (r << 11)] = classifyValues(vals);
+				}
+			}
+		}
+		colorTable.swap(table);
 	}
 
-	// Create matricies for training
-    Mat labelsMat(trainCnt, 1, CV_32SC1);
-    Mat trainingDataMat(trainCnt, SVM_DIM, CV_32FC1);
+	colorTableMode = mode;
+}
+
+/*
+ * Labelled SVM inputs and the number of training pixels which have them
+ */
+struct TrainingSample
+{
+	float vals[2];
+	int label;
+	int count;
+};
+
+static bool sampleLess(const TrainingSample& a, const TrainingSample& b)
+{
+	if (a.label != b.label)
+		return a.label < b.label;
+	if (a.vals[0] != b.vals[0])
+		return a.vals[0] < b.vals[0];
+	return a.vals[1] < b.vals[1];
+}
+
+/*
+ * Sorts samples and merges identical ones, adding up their counts
+ */
+static void collapseSamples(vector<TrainingSample>& samples)
+{
+	sort(samples.begin(), samples.end(), sampleLess);
+
 	int n = 0;
-	for (int k=0;k<trainPaths.size();k++)
+	for (int i=0;i<samples.size();i++)
 	{
-		// Load label image
-		Mat labelImg = imread(labelPaths[k]);
+		if (n > 0 && !sampleLess(samples[n-1], samples[i]))
+			samples[n-1].count += samples[i].count;
+		else
+			samples[n++] = samples[i];
+	}
+	samples.resize(n);
+}
+
+/*
+ * Extracts the labelled pixels of training images, one image at a time. Each
+ * image and label image is read once and walked row by row.
+ */
+class TrainingExtractBody : public ParallelLoopBody
+{
+public:
+	TrainingExtractBody(const vector<string>& trainPaths, const vector<string>& labelPaths, 
+		int *quants, int backgroundScale, vector<vector<TrainingSample> >& samples) :
+		trainPaths(trainPaths), labelPaths(labelPaths), quants(quants), 
+		backgroundScale(backgroundScale), samples(samples) {
+	}
+
+	void operator()(const Range& range) const {
+		for (int k=range.start;k<range.end;k++)
+			extract(k, samples[k]);
+	}
 
-		// Extract label for rectagle
-		labelImg = labelImg(petriRects[k]);
+private:
+	void extract(int k, vector<TrainingSample>& out) const {
+		// Extract rectangles
+		Mat img = imread(trainPaths[k]);
+		Rect petriRect = findPetriRect(img);
+		Mat labelImg = imread(labelPaths[k]);
+		labelImg = labelImg(petriRect);
 
-		// Preprocess training image
-		Mat trainImg = imread(trainPaths[k]);
-		trainImg = preprocessImage(trainImg(petriRects[k]));
+		// Preprocess training image, on this thread only
+		ColonyCounter preprocessor;
+		preprocessor.setBackgroundScale(backgroundScale);
+		Mat trainImg = preprocessor.preprocessImage(img(petriRect));
 
-		for (int x=0;x<trainImg.cols;x++)
+		for (int y=0;y<trainImg.rows;y++)
 		{
-			for (int y=0;y<trainImg.rows;y++)
+			const Vec3b *labelRow = labelImg.ptr<Vec3b>(y);
+			Vec3b *row = trainImg.ptr<Vec3b>(y);
+			for (int x=0;x<trainImg.cols;x++)
 			{
-				Vec3b c = labelImg.at<Vec3b>(y, x);
-				int label = labelColorToIndex(c);
-				if (label >= 0)
-				{
-					Vec3b color = trainImg.at<Vec3b>(y,x);
-					float vals[SVM_DIM];
-					convertColor(color, vals);
+				int label = labelColorToIndex(labelRow[x]);
+				if (label < 0)
+					continue;
 
-					// Quantize values if necessary
-					if (quants) {
-						for (int i=0;i<SVM_DIM;i++)
-							vals[i] = roundf(vals[i] * quants[i])/quants[i];
-					}
+				TrainingSample sample;
+				convertColor(row[x], sample.vals);
 
-					for (int i=0;i<SVM_DIM;i++)
-						trainingDataMat.at<float>(n, i) = vals[i];
-					labelsMat.at<int>(n,0) = label;
-					n++;
+				// Quantize values if necessary
+				if (quants) {
+					for (int i=0;i<2;i++)
+						sample.vals[i] = roundf(sample.vals[i] * quants[i])/quants[i];
 				}
+				sample.label = label;
+				sample.count = 1;
+				out.push_back(sample);
 			}
 		}
+
+		collapseSamples(out);
+	}
+
+	const vector<string>& trainPaths;
+	const vector<string>& labelPaths;
+	int *quants;
+	int backgroundScale;
+	vector<vector<TrainingSample> >& samples;
+};
+
+/*
+ * Trains the classifier given a series of images and a matching
+ * series of label images which are png files that have certain
+ * parts of it marked with either red, cyan or green to indicate
+ * total coliform, E. coli or background respectively.
+ *
+ * Images are processed in parallel (see setNumThreads), and labelled pixels with 
+ * identical inputs are merged. As CvSVM has no per-sample weights, each merged
+ * sample is trained on as one row per pixel, so that it keeps its exact weight.
+ */
+void ColonyCounter::trainClassifier(vector<string> trainPaths, vector<string> labelPaths, int *quants)
+{
+	// Extract samples of each image, then merge them
+	vector<vector<TrainingSample> > imageSamples(trainPaths.size());
+	parallelForBands(trainPaths.size(), numThreads, 
+		TrainingExtractBody(trainPaths, labelPaths, quants, backgroundScale, imageSamples));
+
+	vector<TrainingSample> samples;
+	for (int k=0;k<imageSamples.size();k++)
+	{
+		samples.insert(samples.end(), imageSamples[k].begin(), imageSamples[k].end());
+		vector<TrainingSample>().swap(imageSamples[k]);
+	}
+	collapseSamples(samples);
+
+	// Count pixels and training rows
+	trainingPixels = 0;
+	trainingRows = 0;
+	for (int n=0;n<samples.size();n++)
+	{
+		trainingPixels += samples[n].count;
+		trainingRows += samples[n].count;
+	}
+	trainingSamples = samples.size();
+
+	// Create matricies for training
+    Mat labelsMat(trainingRows, 1, CV_32SC1);
+    Mat trainingDataMat(trainingRows, SVM_DIM, CV_32FC1);
+	int row = 0;
+	for (int n=0;n<samples.size();n++)
+	{
+		for (int k=0;k<samples[n].count;k++)
+		{
+			for (int i=0;i<SVM_DIM;i++)
+				trainingDataMat.at<float>(row, i) = samples[n].vals[i];
+			labelsMat.at<int>(row, 0) = samples[n].label;
+			row++;
+		}
 	}
 
     CvSVMParams params;
@@ -228,85 +744,192 @@ void ColonyCounter::trainClassifier(vector<string> trainPaths, vector<string> la
     bool res = svm.train(trainingDataMat, labelsMat, Mat(), Mat(), params);
 
 	trained = res;
+	buildLinearClassifier();
+}
+
+Mat ColonyWorkspace::reuse(Mat& storage, Size size, int type)
+{
+	size_t bytes = (size_t)size.width * size.height * CV_ELEM_SIZE(type);
+	if (storage.empty() || storage.cols < bytes)
+		storage.create(1, (int)max(bytes, (size_t)1), CV_8U);
+	return Mat(size, type, storage.data);
 }
 
 /*
- * Perform a low pass filter within an arbitrary 3-channel mask. Returns the
- * low-passed image
+ * Perform a low pass filter within an arbitrary 1-channel mask, into blurred
  */
-static Mat lowPass3C(Mat &img, Mat &mask3C, int blurSize) {
-	// Create low-pass filter, only within mask
-	Mat blurred;
-	Mat blurredCount;
-	boxFilter(img & mask3C, blurred, CV_32SC3, Size(blurSize, blurSize),
-		Point(-1, -1), false, BORDER_CONSTANT);
-	boxFilter(mask3C, blurredCount, CV_32SC3, Size(blurSize, blurSize),
-		Point(-1, -1), false, BORDER_CONSTANT);
-	blurred = blurred / (blurredCount / 255);
-	Mat blurred8;
-	blurred.convertTo(blurred8, CV_8UC3);
-	return blurred8;
+static void lowPass(Mat &img, Mat &mask, int blurSize, Mat& blurred, int numThreads, ColonyWorkspace& ws) {
+	maskedMean(img, mask, blurSize, blurred, numThreads, &ws.meanSums);
 }
 
 /*
- * Perform a low pass filter within an arbitrary 1-channel mask. Returns the
- * low-passed image
+ * Removes the outliers in a band of rows from a mask, keeping only pixels
+ * where all channels are within 10 of the low-passed image
  */
-static Mat lowPass(Mat &img, Mat &mask, int blurSize) {
-	Mat mask3C = Mat(img.size(), CV_8UC3, Scalar(0, 0, 0));
-	mask3C.setTo(Scalar(255, 255, 255), mask);
-	return lowPass3C(img, mask3C, blurSize);
-}
+class OutlierBody : public ParallelLoopBody
+{
+public:
+	OutlierBody(const Mat& img, const Mat& lowpass, Mat& bgmask) :
+		img(img), lowpass(lowpass), bgmask(bgmask) {
+	}
+
+	void operator()(const Range& range) const {
+		for (int y=range.start;y<range.end;y++)
+		{
+			const unsigned char *src = img.ptr<unsigned char>(y);
+			const unsigned char *low = lowpass.ptr<unsigned char>(y);
+			unsigned char *dst = bgmask.ptr<unsigned char>(y);
+			for (int x=0;x<img.cols;x++)
+			{
+				if (abs(src[x*3] - low[x*3]) > 10 || abs(src[x*3+1] - low[x*3+1]) > 10 
+					|| abs(src[x*3+2] - low[x*3+2]) > 10)
+					dst[x] = 0;
+			}
+		}
+	}
+
+private:
+	const Mat& img;
+	const Mat& lowpass;
+	Mat& bgmask;
+};
 
 /*
  * Finds the background of an image by removing outliers and then blurring to fill
  * in gaps left by the removal of the outliers.
  */
-static Mat findBackground(Mat& img, Mat& mask, int blurSize, Scalar& backgroundColor, int debug) {
-	Mat lowpass = lowPass(img, mask, blurSize * 2 + 1);
+static Mat findBackground(Mat& img, Mat& mask, int blurSize, Scalar& backgroundColor, int debug, int numThreads,
+	ColonyWorkspace& ws) {
+	Mat lowpass = ColonyWorkspace::reuse(ws.lowpassStorage, img.size(), CV_8UC3);
+	lowPass(img, mask, blurSize * 2 + 1, lowpass, numThreads, ws);
 
-	// Get outliers and remove from mask
-	Mat diff1 = img-lowpass;
-	Mat diff2 = lowpass-img;
-	
 	if (debug) {
-		imshow("diff1", diff1);
-		imshow("diff2", diff2);
+		imshow("diff1", img-lowpass);
+		imshow("diff2", lowpass-img);
 	}
 
-	Mat background1, background2;
-	threshold(diff1, background1, 10, 255, CV_THRESH_BINARY_INV);
-	threshold(diff2, background2, 10, 255, CV_THRESH_BINARY_INV);
-
 	// Keep only pixels where all channels are close to lowpass
-	Mat bgmask = mask.clone();
-	vector<Mat> channels;
-	split(background1&background2, channels);
+	Mat bgmask = ColonyWorkspace::reuse(ws.bgmaskStorage, img.size(), CV_8UC1);
+	mask.copyTo(bgmask);
+	parallelForBands(img.rows, numThreads, OutlierBody(img, lowpass, bgmask));
 
-	// Get background mask
-	for (int i=0;i<channels.size();i++) {
-		bgmask &= channels[i];
+	if (debug) {
+		imshow("bgmask", bgmask);
 	}
 
-	if (debug) {
-		imshow("background1", background1);
-		imshow("background2", background2);
+	// Calculate background. If there were no outliers, it is the same as lowpass
+	Mat background;
+	if (countNonZero(bgmask) == countNonZero(mask))
+		background = lowpass;
+	else {
+		background = ColonyWorkspace::reuse(ws.backgroundStorage, img.size(), CV_8UC3);
+		lowPass(img, bgmask, blurSize * 2 + 1, background, numThreads, ws);
 	}
 
-	// Calculate background
-	Mat background = lowPass(img, bgmask, blurSize * 2 + 1);
+	// Get average background color
+	backgroundColor = mean(background, bgmask);
+
+	return background;
+}
+
+/*
+ * Finds the background of an image at a reduced scale, then upsamples it 
+ * back to the size of the image.
+ */
+static Mat findBackgroundScaled(Mat& img, Mat& mask, int blurSize, Scalar& backgroundColor, int debug, int numThreads, 
+	int scale, ColonyWorkspace& ws) {
+	if (scale <= 1)
+		return findBackground(img, mask, blurSize, backgroundColor, debug, numThreads, ws);
 
-	Mat bgmask3C = Mat(img.size(), CV_8UC3, Scalar(0, 0, 0));
-	bgmask3C.setTo(Scalar(255, 255, 255), bgmask);
+	Size smallSize((img.cols + scale - 1) / scale, (img.rows + scale - 1) / scale);
+	Mat smallImg = ColonyWorkspace::reuse(ws.smallImgStorage, smallSize, CV_8UC3);
+	Mat smallMask = ColonyWorkspace::reuse(ws.smallMaskStorage, smallSize, CV_8UC1);
+	resize(img, smallImg, smallSize, 0, 0, INTER_AREA);
 
-	// Get average background color
-	Scalar backTotal = sum(background & bgmask3C);
-	Scalar backCnt = sum(bgmask)/Scalar(255);
-	backgroundColor = backTotal/(backCnt[0]);
+	// Keep only pixels entirely within the mask, so that the edge of the plate does not bleed in
+	resize(mask, smallMask, smallSize, 0, 0, INTER_AREA);
+	threshold(smallMask, smallMask, 254, 255, THRESH_BINARY);
 
+	Mat smallBackground = findBackground(smallImg, smallMask, max(blurSize / scale, 1), backgroundColor, debug, numThreads, ws);
+
+	Mat background = ColonyWorkspace::reuse(ws.fullBackgroundStorage, img.size(), CV_8UC3);
+	resize(smallBackground, background, img.size(), 0, 0, INTER_LINEAR);
 	return background;
 }
 
+/*
+ * High-passes a band of rows of a petri image against its background,
+ * setting everything outside of the circular mask to background
+ */
+class HighPassBody : public ParallelLoopBody
+{
+public:
+	HighPassBody(const Mat& petri, const Mat& background, const Mat& mask, Mat& highpass) :
+		petri(petri), background(background), mask(mask), highpass(highpass) {
+	}
+
+	void operator()(const Range& range) const {
+		for (int y=range.start;y<range.end;y++)
+			normalizeRow(petri.ptr<unsigned char>(y), background.ptr<unsigned char>(y), 
+				mask.ptr<unsigned char>(y), highpass.ptr<unsigned char>(y), petri.cols);
+	}
+
+private:
+	const Mat& petri;
+	const Mat& background;
+	const Mat& mask;
+	Mat& highpass;
+};
+
+/*
+ * High-passes and classifies a band of rows of a petri image, one row at
+ * a time, so that the high-passed image is never stored
+ */
+class HighPassClassifyBody : public ParallelLoopBody
+{
+public:
+	HighPassClassifyBody(ColonyCounter& colonyCounter, const Mat& petri, const Mat& background, 
+		const Mat& mask, Mat& classified, vector<vector<unsigned char> >& rows) :
+		colonyCounter(colonyCounter), petri(petri), background(background), mask(mask), classified(classified), 
+		rows(rows) {
+	}
+
+	void operator()(const Range& range) const {
+		vector<unsigned char>& row = rows[bandIndex(range.start, petri.rows, colonyCounter.numThreads)];
+		if (row.size() < petri.cols * 3)
+			row.resize(petri.cols * 3);
+		for (int y=range.start;y<range.end;y++)
+		{
+			normalizeRow(petri.ptr<unsigned char>(y), background.ptr<unsigned char>(y), 
+				mask.ptr<unsigned char>(y), &row[0], petri.cols);
+			colonyCounter.classifyRow(&row[0], classified.ptr<unsigned char>(y), petri.cols);
+		}
+	}
+
+private:
+	ColonyCounter& colonyCounter;
+	const Mat& petri;
+	const Mat& background;
+	const Mat& mask;
+	Mat& classified;
+	vector<vector<unsigned char> >& rows;
+};
+
+/*
+ * Gets the mask of the circle which fits within a petri rectangle, keeping it
+ * in the workspace for the next rectangle of the same size
+ */
+static Mat circleMask(Size size, ColonyWorkspace& ws)
+{
+	Mat mask = ColonyWorkspace::reuse(ws.circleMaskStorage, size, CV_8UC1);
+	if (ws.circleMaskSize != size)
+	{
+		mask.setTo(Scalar(0));
+		circle(mask, Point(mask.cols/2, mask.rows/2), mask.rows/2, Scalar(255), CV_FILLED);
+		ws.circleMaskSize = size;
+	}
+	return mask;
+}
 
 /*
  * Preprocesses a petri rectangle, normalizing all colors to 200=white
@@ -322,79 +945,246 @@ Mat ColonyCounter::preprocessImage(Mat petri)
  * Preprocesses a petri rectangle, also returning the original background color
  */
 Mat ColonyCounter::preprocessImage(Mat petri, Scalar& backgroundColor) 
+{
+	ColonyWorkspace workspace;
+	Mat highpass;
+	preprocessImage(petri, highpass, backgroundColor, workspace);
+	return highpass;
+}
+
+/*
+ * Preprocesses a petri rectangle into highpass, using the buffers of a workspace
+ */
+void ColonyCounter::preprocessImage(Mat petri, Mat& highpass, Scalar& backgroundColor, ColonyWorkspace& workspace) 
 {
 	// Create mask
-	Mat mask(petri.size(), CV_8UC1, Scalar(0));
-	circle(mask, Point(mask.cols/2, mask.rows/2), mask.rows/2, Scalar(255), CV_FILLED);
+	Mat mask = circleMask(petri.size(), workspace);
 
-	Mat background = findBackground(petri, mask, mask.rows/5, backgroundColor, false);
+	Mat background = findBackgroundScaled(petri, mask, mask.rows/5, backgroundColor, false, numThreads, 
+		backgroundScale, workspace);
 	
 	// High-pass image
-	Mat highpass;
-	highpass = (petri * 200) / background;
-
-	// Mask outside of circle to background
-	highpass.setTo(Scalar(200, 200, 200), 255 - mask);
-
-	return highpass;
+	highpass.create(petri.size(), CV_8UC3);
+	parallelForBands(petri.rows, numThreads, HighPassBody(petri, background, mask, highpass));
 }
 
-/* Calculate the circularity of a contour */
-static double calcCircularity(vector<Point> contour) {
-	// Check circularity
-	double perimeter = arcLength(contour, true);
-	double area = contourArea(contour);
-	double circularity = 4 * 3.14159265 * area / (perimeter * perimeter);
-	return circularity;
+/*
+ * Preprocesses and classifies a petri rectangle in a single pass. Gives 
+ * the same result as classifyImage(preprocessImage(petri)) without 
+ * storing the preprocessed image.
+ */
+Mat ColonyCounter::classifyPetri(Mat petri) 
+{
+	ColonyWorkspace workspace;
+	Mat classified;
+	classifyPetri(petri, classified, workspace);
+	return classified;
 }
 
 /*
- * Counts colonies of a particular type on a classified image
- * Removes tiny colonies, joins colonies that are close together
- *  and then keeps appropriate candidate contours.
+ * Preprocesses and classifies a petri rectangle into classified, using the
+ * buffers of a workspace
  */
-static vector<vector<Point> > countType(Mat classified, int type) 
+void ColonyCounter::classifyPetri(Mat petri, Mat& classified, ColonyWorkspace& workspace) 
 {
-	// Get type mask
-	Mat mask = classified == type;
+	Mat mask = circleMask(petri.size(), workspace);
 
-	// Remove tiny colonies
-	Mat kernel = getStructuringElement(MORPH_CROSS, Size(3, 3));
-	erode(mask, mask, kernel);
-	dilate(mask, mask, kernel);
-	erode(mask, mask, kernel);
+	Scalar backgroundColor;
+	Mat background = findBackgroundScaled(petri, mask, mask.rows/5, backgroundColor, false, numThreads, 
+		backgroundScale, workspace);
+
+	classified.create(petri.size(), CV_8U);
+	int numBands = bandCount(petri.rows, numThreads);
+	if (workspace.rows.size() < numBands)
+		workspace.rows.resize(numBands);
+	parallelForBands(petri.rows, numThreads, 
+		HighPassClassifyBody(*this, petri, background, mask, classified, workspace.rows));
+}
 
-	// Dilate, erode to join colonies
-	kernel = getStructuringElement(MORPH_ELLIPSE, Size(5, 5));
-	dilate(mask, mask, kernel);
-	erode(mask, mask, kernel);
-	dilate(mask, mask, kernel);
-	erode(mask, mask, kernel);
+/* Calculate the circularity of a component */
+static double calcCircularity(const Component& comp) {
+	return 4 * 3.14159265 * comp.area / (comp.perimeter * comp.perimeter);
+}
 
-	// Find contours
-	vector<vector<Point> > contours;
-	vector<Vec4i> hierarchy;
-	findContours(mask, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
+/*
+ * Removes tiny colonies and joins colonies that are close together, for both
+ * types at once. planes[0] is red (type 1) and planes[1] is blue (type 2)
+ */
+static void cleanColonyPlanes(Mat classified, BitPlane *planes, int numThreads, BitMorphWorkspace& workspace)
+{
+	int types[] = { 1, 2 };
+	packClasses(classified, types, planes, 2, numThreads);
+
+	static const BitMorphOp ops[] = {
+		// Remove tiny colonies
+		{ BIT_MORPH_CROSS3, false },
+		{ BIT_MORPH_CROSS3, true },
+		{ BIT_MORPH_CROSS3, false },
+
+		// Dilate, erode to join colonies
+		{ BIT_MORPH_ELLIPSE5, true },
+		{ BIT_MORPH_ELLIPSE5, false },
+		{ BIT_MORPH_ELLIPSE5, true },
+		{ BIT_MORPH_ELLIPSE5, false }
+	};
+	morphBitPlanes(planes, 2, ops, sizeof(ops) / sizeof(ops[0]), numThreads, &workspace);
+}
 
+/*
+ * Checks if a component of a cleaned up plane is an appropriate colony:
+ * large and round enough, and not hidden within another one
+ */
+static bool isColony(const Component& comp)
+{
 	int minArea = 4;
 	double minCircularity = 0.2;
 
-	// For each suitable one
-	vector<vector<Point> > goodContours;
-	for (int i=0;i<contours.size();i++) 
+	if (comp.nested || comp.area < minArea)
+		return false;
+	return calcCircularity(comp) > minCircularity;
+}
+
+/*
+ * Draws the colonies among the components of a plane as drawContours would draw
+ * their outer contours: filled, holes included, with the pixels on the outer 
+ * boundary outlined
+ */
+static void drawColonies(Mat& image, const vector<Component>& components,
+	const vector<ComponentRun>& runs, Vec3b fill, Vec3b outline)
+{
+	const unsigned char OUTSIDE = 128;
+
+	// Draw each colony alone, with a clear border around it
+	vector<Mat> masks(components.size());
+	for (int c=0;c<components.size();c++)
+	{
+		if (isColony(components[c]))
+			masks[c] = Mat(components[c].bounds.size() + Size(2, 2), CV_8U, Scalar(0));
+	}
+	for (int r=0;r<runs.size();r++)
+	{
+		const ComponentRun& run = runs[r];
+		Mat& mask = masks[run.component];
+		if (mask.empty())
+			continue;
+
+		const Rect& bounds = components[run.component].bounds;
+		mask.row(run.y - bounds.y + 1).colRange(run.start - bounds.x + 1, run.end - bounds.x + 1).setTo(Scalar(255));
+	}
+
+	for (int c=0;c<masks.size();c++)
+	{
+		Mat& mask = masks[c];
+		if (mask.empty())
+			continue;
+
+		// Mark the outside from the border. The background of an 8-connected 
+		// component is 4-connected, as floodFill fills, so what is left is holes
+		floodFill(mask, Point(0, 0), Scalar(OUTSIDE));
+
+		Point origin = components[c].bounds.tl() - Point(1, 1);
+		for (int y=1;y<mask.rows-1;y++)
+		{
+			const unsigned char *above = mask.ptr<unsigned char>(y - 1);
+			const unsigned char *row = mask.ptr<unsigned char>(y);
+			const unsigned char *below = mask.ptr<unsigned char>(y + 1);
+			Vec3b *dst = image.ptr<Vec3b>(origin.y + y) + origin.x;
+			for (int x=1;x<mask.cols-1;x++)
+			{
+				if (row[x] == OUTSIDE)
+					continue;
+				bool boundary = row[x - 1] == OUTSIDE || row[x + 1] == OUTSIDE || 
+					above[x] == OUTSIDE || below[x] == OUTSIDE;
+				dst[x] = boundary ? outline : fill;
+			}
+		}
+	}
+}
+
+/*
+ * Colors the pixels of a debug image by their class
+ */
+void ColonyCounter::renderClassified(Mat classified, Mat& demo)
+{
+	demo.create(classified.size(), CV_8UC3);
+	for (int y=0;y<classified.rows;y++)
 	{
-		// Make sure area is sufficiently large
-		if (contourArea(contours[i])>=minArea)
+		const unsigned char *cls = classified.ptr<unsigned char>(y);
+		Vec3b *dst = demo.ptr<Vec3b>(y);
+		for (int x=0;x<classified.cols;x++)
 		{
-			// Check circularity
-			double circularity = calcCircularity(contours[i]);
-			if (circularity > minCircularity)
-				goodContours.push_back(contours[i]);
+			if (cls[x] == 0)
+				dst[x] = Vec3b(255,255,255);
+			if (cls[x] == 1)
+				dst[x] = Vec3b(0,0,255);
+			if (cls[x] == 2)
+				dst[x] = Vec3b(255,0,0);
 		}
 	}
-	return goodContours;
 }
 
+/*
+ * Classifies one row of BGR pixels, using the color table, the lookup table
+ * or the support vector machine, whichever is available
+ */
+void ColonyCounter::classifyRow(const unsigned char *src, unsigned char *dst, int n)
+{
+	// Use color table if present, which needs only one lookup per pixel
+	if (colorTableMode != COLOR_TABLE_NONE)
+	{
+		const unsigned char *table = &colorTable[0];
+		for (int x=0;x<n;x++)
+			dst[x] = table[colorTableIndex(src + x*3)];
+		return;
+	}
+
+	// Use quantization if present
+	if (svmLookup)
+	{
+		assert(SVM_DIM == 2);
+		classifyLookupRow(src, dst, n, svmLookup, svmQuants);
+		return;
+	}
+
+	// Use hyperplanes of linear SVM if present
+	if (linearEnabled && !linearPlanes.empty())
+	{
+		classifyLinearRow(src, dst, n, &linearPlanes[0], linearPlanes.size(), 
+			&linearLabels[0], linearLabels.size());
+		return;
+	}
+
+	vector<float> lightness(n), redBlue(n);
+	computeColorFeatures(src, &lightness[0], &redBlue[0], n);
+	for (int x=0;x<n;x++)
+	{
+		float vals[SVM_DIM] = { lightness[x], redBlue[x] };
+		dst[x] = classifyValues(vals);
+	}
+}
+
+/*
+ * Classifies a band of rows of an image
+ */
+class ClassifyBody : public ParallelLoopBody
+{
+public:
+	ClassifyBody(ColonyCounter& colonyCounter, const Mat& img, Mat& classified) :
+		colonyCounter(colonyCounter), img(img), classified(classified) {
+	}
+
+	void operator()(const Range& range) const {
+		// Walk rows in memory order
+		for (int y=range.start;y<range.end;y++)
+			colonyCounter.classifyRow(img.ptr<unsigned char>(y), classified.ptr<unsigned char>(y), img.cols);
+	}
+
+private:
+	ColonyCounter& colonyCounter;
+	const Mat& img;
+	Mat& classified;
+};
+
 /*
  * Classifies an image's pixels using the support vector machine
  */
@@ -402,33 +1192,10 @@ Mat ColonyCounter::classifyImage(Mat img, bool debug, Mat *debugImage)
 {
 	Mat classified(img.size(), CV_8U);
 
-	Mat demo;
-	if (debug)
-		demo = img.clone();
+	parallelForBands(img.rows, numThreads, ClassifyBody(*this, img, classified));
 
-	// Show predictions
-	for (int x=0;x<img.cols;x++)
-	{
-		for (int y=0;y<img.rows;y++)
-		{
-			Vec3b color = img.at<Vec3b>(y,x);
-			float vals[SVM_DIM];
-			convertColor(color, vals);
-			int cls = classifyValues(vals);
-			classified.at<unsigned char>(y,x)=cls;
-			if (debug) 
-			{
-				if (cls == 0)
-					demo.at<Vec3b>(y,x)=Vec3b(255,255,255);
-				if (cls == 1)
-					demo.at<Vec3b>(y,x)=Vec3b(0,0,255);
-				if (cls == 2)
-					demo.at<Vec3b>(y,x)=Vec3b(255,0,0);
-			}
-		}
-	}
 	if (debug) 
-		demo.copyTo(*debugImage);
+		renderClassified(classified, *debugImage);
 
 	return classified;
 }
@@ -440,37 +1207,24 @@ Mat ColonyCounter::classifyImageQuant(Mat img, bool debug, Mat *debugImage, int*
 {
 	Mat classified(img.size(), CV_8U);
 
-	Mat demo;
-	if (debug)
-		demo = img.clone();
-
-	// Show predictions
-	for (int x=0;x<img.cols;x++)
+	vector<float> lightness(img.cols), redBlue(img.cols);
+	for (int y=0;y<img.rows;y++)
 	{
-		for (int y=0;y<img.rows;y++)
+		unsigned char *dst = classified.ptr<unsigned char>(y);
+		computeColorFeatures(img.ptr<unsigned char>(y), &lightness[0], &redBlue[0], img.cols);
+		for (int x=0;x<img.cols;x++)
 		{
-			Vec3b color = img.at<Vec3b>(y,x);
-			float vals[SVM_DIM];
-			convertColor(color, vals);
+			float vals[SVM_DIM] = { lightness[x], redBlue[x] };
 
 			for (int i=0;i<SVM_DIM;i++)
 				vals[i] = roundf(vals[i] * quants[i])/quants[i];
 
-			int cls = classifyValues(vals);
-			classified.at<unsigned char>(y,x)=cls;
-			if (debug)
-			{
-				if (cls == 0)
-					demo.at<Vec3b>(y,x)=Vec3b(255,255,255);
-				if (cls == 1)
-					demo.at<Vec3b>(y,x)=Vec3b(0,0,255);
-				if (cls == 2)
-					demo.at<Vec3b>(y,x)=Vec3b(255,0,0);
-			}
+			dst[x] = classifyValues(vals);
 		}
 	}
+
 	if (debug)
-		demo.copyTo(*debugImage);
+		renderClassified(classified, *debugImage);
 
 	return classified;
 }
@@ -513,27 +1267,98 @@ void ColonyCounter::testQuantization(Mat img, int* quants)
 	printf("wrong redblue=%5d  of %10d\n", wrongrb, totalrb);
 }
 
+/*
+ * Labels the components of one or both types in their cleaned up planes. Index 0 
+ * is red (type 1) and index 1 is blue (type 2)
+ */
+class CountTypeBody : public ParallelLoopBody
+{
+public:
+	CountTypeBody(ColonyWorkspace& workspace, bool keepRuns) :
+		workspace(workspace), keepRuns(keepRuns) {
+	}
+
+	void operator()(const Range& range) const {
+		for (int i=range.start;i<range.end;i++)
+			workspace.labelers[i].label(workspace.planes[i], workspace.components[i], 
+				keepRuns ? &workspace.runs[i] : NULL);
+	}
+
+private:
+	ColonyWorkspace& workspace;
+	bool keepRuns;
+};
+
 /*
  * Counts colonies on and appropriately classified image, optionally
  * returning debugging information
  */
 void ColonyCounter::countColonies(Mat classified, int& red, int &blue, bool debug, Mat *debugImage) 
 {
-	vector<vector<Point> > redContours, blueContours;
+	vector<Colony> colonies;
+	countColonies(classified, colonies, debug, debugImage);
 
-	blueContours = countType(classified, 2);
-	redContours = countType(classified, 1);
+	red = 0;
+	blue = 0;
+	for (int i=0;i<colonies.size();i++)
+	{
+		if (colonies[i].type == 1)
+			red++;
+		else
+			blue++;
+	}
+}
 
+/*
+ * Finds colonies on an appropriately classified image, optionally returning
+ * debugging information
+ */
+void ColonyCounter::countColonies(Mat classified, vector<Colony>& colonies, bool debug, Mat *debugImage) 
+{
+	ColonyWorkspace workspace;
+	countColonies(classified, colonies, workspace, debug, debugImage);
+}
+
+/*
+ * Finds colonies on an appropriately classified image, using the buffers of a
+ * workspace
+ */
+void ColonyCounter::countColonies(Mat classified, vector<Colony>& colonies, ColonyWorkspace& workspace, 
+	bool debug, Mat *debugImage) 
+{
+	// Clean up both types in the same passes, 64 pixels at a time
+	BitPlane *planes = workspace.planes;
+	cleanColonyPlanes(classified, planes, numThreads, workspace.morph);
+
+	// Label both types at once if there are threads to spare. Runs are only
+	// needed to draw the colonies
+	parallelForBands(2, min(numThreads, 2), CountTypeBody(workspace, debug));
+
+	vector<Component> *typeComponents = workspace.components;
 	if (debug) 
 	{
-		Mat contours(classified.size(), CV_8UC3, Scalar(255, 255, 255));
-		drawContours(contours, redContours, -1, Scalar(128,128,255), -1);
-		drawContours(contours, redContours, -1, Scalar(0,0,255));
-		drawContours(contours, blueContours, -1, Scalar(255,125,128), -1);
-		drawContours(contours, blueContours, -1, Scalar(255,0,0));
-		contours.copyTo(*debugImage);
+		Mat image(classified.size(), CV_8UC3, Scalar(255, 255, 255));
+		drawColonies(image, typeComponents[0], workspace.runs[0], Vec3b(128,128,255), Vec3b(0,0,255));
+		drawColonies(image, typeComponents[1], workspace.runs[1], Vec3b(255,125,128), Vec3b(255,0,0));
+		image.copyTo(*debugImage);
 	}
 
-	red = redContours.size();
-	blue = blueContours.size();
+	colonies.clear();
+	for (int i=0;i<2;i++)
+	{
+		for (int c=0;c<typeComponents[i].size();c++)
+		{
+			const Component& comp = typeComponents[i][c];
+			if (!isColony(comp))
+				continue;
+
+			Colony colony;
+			colony.type = i + 1;
+			colony.centroid = comp.centroid;
+			colony.area = comp.area;
+			colony.circularity = calcCircularity(comp);
+			colony.bounds = comp.bounds;
+			colonies.push_back(colony);
+		}
+	}
 }
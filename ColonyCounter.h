@@ -2,22 +2,101 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "BitPlane.h"
+#include "ClassifyKernel.h"
+#include "ComponentLabeler.h"
+
+/*
+ * A colony found by countColonies, in the coordinates of the classified image
+ */
+struct Colony
+{
+	int type;					// 1 for red, 2 for blue, as in the classified image
+	cv::Point2d centroid;		// Mean position of its pixels
+	double area;				// Area within its outline
+	double circularity;			// 4*pi*area/perimeter^2, 1 for a circle
+	cv::Rect bounds;			// Bounding box of its pixels
+};
+
+/*
+ * Buffers for analysing one plate at a time, kept between plates so that
+ * they are only allocated again when a plate needs more room. Each worker
+ * thread owns a workspace and passes it with each plate. Matrices made from
+ * the workspace are only valid while it is.
+ */
+struct ColonyWorkspace
+{
+	// Gets a matrix of a size and type whose data is kept in storage, which only
+	// grows, so that plates of different sizes share the same memory
+	static cv::Mat reuse(cv::Mat& storage, cv::Size size, int type);
+
+	// Mask of the circle within a petri rectangle, and the size it was made for
+	cv::Mat circleMaskStorage;
+	cv::Size circleMaskSize;
+
+	// Background estimation: image and mask at reduced scale, low-passed image,
+	// mask without outliers, background at reduced and full scale
+	cv::Mat smallImgStorage, smallMaskStorage, lowpassStorage, bgmaskStorage;
+	cv::Mat backgroundStorage, fullBackgroundStorage;
+
+	// Column sums of the masked mean and high-passed row of each band
+	std::vector<std::vector<int> > meanSums;
+	std::vector<std::vector<unsigned char> > rows;
+
+	// Classified plate and its colonies, for callers that keep neither
+	cv::Mat classifiedStorage;
+	std::vector<Colony> colonies;
+
+	// Cleaned up planes of each colony type, and their components
+	BitPlane planes[2];
+	BitMorphWorkspace morph;
+	ComponentLabeler labelers[2];
+	std::vector<Component> components[2];
+	std::vector<ComponentRun> runs[2];
+};
+
 /*
  * Main class for counting colonies. Uses a Support Vector Machine to
  * classify pixel colors. Can also use a 2-dimentional lookup table to
  * classify pixels. To use a lookup table, use loadTrainingQuantized.
  * Lookup table is used as the Support Vector Machine is quite slow
  *
+ * The lookup table can also be loaded from a binary model file written by
+ * saveTrainingBinary, using loadTrainingBinary. The file is memory-mapped
+ * read-only, so processes using the same model share its pages.
+ *
+ * A linear SVM (as trained by trainClassifier) is not called for each pixel.
+ * Its pairwise hyperplanes are extracted when it is loaded or trained, and 
+ * pixels are classified by voting over those directly. Classes are nearly
+ * identical, but can differ close to a boundary, as CvSVM sums the kernel values
+ * rounded to float. test-linear reports how often they differ.
+ *
+ * For the fastest classification, call buildColorTable after loading the
+ * training. This precomputes the class of every BGR color so that each
+ * pixel is classified with a single table lookup.
+ *
  * Basic usage:
  *  loadTraining(...)
  *  preprocessImage(...)
  *  classifyImage(...)
  *  countColonies(...)
  *
+ * or, without keeping the preprocessed image:
+ *  loadTraining(...)
+ *  classifyPetri(...)
+ *  countColonies(...)
+ *
  */
 class ColonyCounter
 {
 public:
+	// Size of the BGR color table built by buildColorTable
+	enum ColorTableMode {
+		COLOR_TABLE_NONE,		// No color table, classify from the SVM inputs
+		COLOR_TABLE_565,		// 5/6/5 bits of blue/green/red (64 KB)
+		COLOR_TABLE_FULL		// All 24 bits of the color (16 MB)
+	};
+
 	ColonyCounter(void);
 	~ColonyCounter(void);
 
@@ -25,24 +104,64 @@ public:
 	void loadTraining(const char *path);
 	void loadTrainingQuantized(unsigned char *svmLookup, int *svmQuants);
 	void saveTraining(const char *path);
-	void saveTrainingQuantized(const char *path, int *svmQuants);
+	bool saveTrainingQuantized(const char *path, int *svmQuants, const char *binaryPath = NULL);
+
+	// Loads and saves the lookup table as a binary model file. loadTrainingBinary
+	// returns false, keeping the current training, if the file is not a valid model
+	bool loadTrainingBinary(const char *path);
+	bool saveTrainingBinary(const char *path, int *svmQuants);
+
+	// Enables (the default) or disables classifying with the hyperplanes of a linear
+	// SVM instead of calling the SVM itself. See buildLinearClassifier
+	void setLinearClassifier(bool enabled);
+
+	// Precomputes the class of every color from the current training. Must be
+	// called again after the training changes.
+	void buildColorTable(ColorTableMode mode);
+
+	// Sets the number of threads to use for each image. 1 (default) is single-threaded
+	// and 0 uses all cores. Results are identical for any number of threads.
+	void setNumThreads(int numThreads);
+
+	// Sets the reduction (1, 4 or 8) at which the background is estimated. 1 (default) is full resolution
+	void setBackgroundScale(int scale);
 
 	// Trains the classifier given a set of sample images and label images which indicate
 	// whether certain pixels are background, red colonies or blue colonies
 	void trainClassifier(std::vector<std::string> trainPaths, std::vector<std::string> labelPaths, int *quants = NULL);
 
+	// Number of labelled pixels, of distinct samples they were merged into and of
+	// rows the SVM was trained on, in the last trainClassifier
+	long getTrainingPixels() const { return trainingPixels; }
+	int getTrainingSamples() const { return trainingSamples; }
+	int getTrainingRows() const { return trainingRows; }
+
 	// Cleans up and normalizes an extracted petri film rectangle, keeping only the circle 
 	// which fits within the rectangle.
 	cv::Mat preprocessImage(cv::Mat petri, cv::Scalar& backgroundColor);
 	cv::Mat preprocessImage(cv::Mat petri);
+	void preprocessImage(cv::Mat petri, cv::Mat& highpass, cv::Scalar& backgroundColor, ColonyWorkspace& workspace);
 
 	// Classifies pixels within a preprocessed image to determine colony type or background
 	cv::Mat classifyImage(cv::Mat img, bool debug = false, cv::Mat *debugImage = NULL);
 	cv::Mat classifyImageQuant(cv::Mat img, bool debug = false, cv::Mat *debugImage = NULL, int* quants = NULL);
 
+	// Preprocesses and classifies an extracted petri film rectangle in one pass
+	cv::Mat classifyPetri(cv::Mat petri);
+	void classifyPetri(cv::Mat petri, cv::Mat& classified, ColonyWorkspace& workspace);
+
+	// Colors a classified image for display (white background, red and blue colonies)
+	static void renderClassified(cv::Mat classified, cv::Mat& debugImage);
+
 	// Counts colonies in a classified image
 	void countColonies(cv::Mat classified, int& red, int &blue, bool debug = false, cv::Mat *debugImage = NULL);
 
+	// Finds the colonies in a classified image, red ones first, each in order of
+	// their first row
+	void countColonies(cv::Mat classified, std::vector<Colony>& colonies, bool debug = false, cv::Mat *debugImage = NULL);
+	void countColonies(cv::Mat classified, std::vector<Colony>& colonies, ColonyWorkspace& workspace, 
+		bool debug = false, cv::Mat *debugImage = NULL);
+
 	// Test a quantization and prints debug info
 	void testQuantization(cv::Mat img, int* quants);
 
@@ -60,6 +179,57 @@ private:
 	// Quantization values to use
 	int *svmQuants;
 
+	// Memory-mapped model file that svmLookup points into, if any. See loadTrainingBinary
+	void *modelMapping;
+	size_t modelMappingSize;
+	int modelQuants[SVM_DIM];
+	void unmapModel();
+
+	// Not copyable, as the copy would share the mapping
+	ColonyCounter(const ColonyCounter&);
+	ColonyCounter& operator=(const ColonyCounter&);
+
+	// Computes the lookup table of the current training for a quantization
+	void computeQuantizedTable(int *svmQuants, std::vector<unsigned char>& table);
+	friend class QuantizedTableBody;
+
+	// Number of threads for per-pixel stages. See setNumThreads
+	int numThreads;
+
+	// Reduction at which the background is estimated. See setBackgroundScale
+	int backgroundScale;
+
+	// Size of the last training. See getTrainingPixels
+	long trainingPixels;
+	int trainingSamples, trainingRows;
+
+	// Hyperplanes of a linear SVM, classes of its labels, and whether to use them.
+	// See buildLinearClassifier
+	std::vector<LinearPlane> linearPlanes;
+	std::vector<unsigned char> linearLabels;
+	bool linearEnabled;
+	bool buildLinearClassifier();
+
+	// Lookup table from BGR color to class. See buildColorTable
+	std::vector<unsigned char> colorTable;
+	ColorTableMode colorTableMode;
+
+	// Gets the index into colorTable of a BGR pixel
+	inline int colorTableIndex(const unsigned char *bgr) const
+	{
+		if (colorTableMode == COLOR_TABLE_FULL)
+			return bgr[0] | (bgr[1] << 8) | (bgr[2] << 16);
+		return (bgr[0] >> 3) | ((bgr[1] >> 2) << 5) | ((bgr[2] >> 3) << 11);
+	}
+
 	// Classify a set of values that have been computed from a pixel
 	int classifyValues(float* vals);
+
+	// Classify each row of a CV_32F matrix of values, as classifyValues does
+	void classifyValuesBatch(const cv::Mat& samples, unsigned char *classes);
+
+	// Classify a row of n BGR pixels
+	void classifyRow(const unsigned char *src, unsigned char *dst, int n);
+	friend class ClassifyBody;
+	friend class HighPassClassifyBody;
 };
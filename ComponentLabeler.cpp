@@ -0,0 +1,347 @@
+#include "stdafx.h"
+#include <opencv2/opencv.hpp>
+#include <math.h>
+#include <algorithm>
+
+#include "ComponentLabeler.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+ * ComponentLabeler::BlockSums are sums over the 2x2 blocks of pixels assigned
+ * to a run. Blocks are classified by which of their pixels are set:
+ *  all four:				the contour covers the block (area 1)
+ *  three:					the contour covers half of it and cuts across the diagonal
+ *  two side by side:		the contour runs along the side, in both directions
+ *							unless the block on the other side covers it
+ *  two diagonally:			the contour crosses the diagonal in both directions
+ *  one:					only counted for the Euler number
+ */
+typedef ComponentLabeler::BlockSums BlockSums;
+
+// Masks of the blocks of a row of blocks, one bit per block
+enum BlockClass { BLOCK_FULL, BLOCK_THREE, BLOCK_SIDE, BLOCK_DIAGONAL, BLOCK_ONE, NUM_BLOCK_CLASSES };
+
+/*
+ * Number of set bits of a mask in positions [start, end]
+ */
+static inline int countBits(const uint64_t *mask, int start, int end)
+{
+	int first = start >> 6, last = end >> 6;
+	uint64_t firstMask = ~0ULL << (start & 63);
+	uint64_t lastMask = ~0ULL >> (63 - (end & 63));
+	if (first == last)
+		return __builtin_popcountll(mask[first] & firstMask & lastMask);
+
+	int count = __builtin_popcountll(mask[first] & firstMask);
+	for (int i=first+1;i<last;i++)
+		count += __builtin_popcountll(mask[i]);
+	return count + __builtin_popcountll(mask[last] & lastMask);
+}
+
+/*
+ * Adds the blocks in positions [start, end] of the block masks to sums
+ */
+static void addBlocks(uint64_t * const *masks, int start, int end, BlockSums& sums)
+{
+	int full = countBits(masks[BLOCK_FULL], start, end);
+	int three = countBits(masks[BLOCK_THREE], start, end);
+	int side = countBits(masks[BLOCK_SIDE], start, end);
+	int diagonal = countBits(masks[BLOCK_DIAGONAL], start, end);
+	int one = countBits(masks[BLOCK_ONE], start, end);
+
+	sums.area2 += full * 2 + three;
+	sums.sides += side;
+	sums.diagonals += three + diagonal * 2;
+	sums.euler4 += one - three - diagonal * 2;
+}
+
+/*
+ * Classifies the blocks formed by rows top and bottom. Block j covers columns
+ * j-1 and j. Blocks with a pixel set in the top row go into topMasks, and the
+ * others into bottomMasks, so that each block is assigned to one run.
+ */
+static void classifyBlocks(const uint64_t *top, const uint64_t *bottom, int n,
+	uint64_t **topMasks, uint64_t **bottomMasks)
+{
+	for (int i=0;i<n;i++)
+	{
+		uint64_t tl = (top[i] << 1) | (i > 0 ? top[i-1] >> 63 : 0), tr = top[i];
+		uint64_t bl = (bottom[i] << 1) | (i > 0 ? bottom[i-1] >> 63 : 0), br = bottom[i];
+
+		uint64_t masks[NUM_BLOCK_CLASSES];
+		masks[BLOCK_FULL] = tl & tr & bl & br;
+		masks[BLOCK_THREE] = (tl & tr & (bl ^ br)) | (bl & br & (tl ^ tr));
+		masks[BLOCK_SIDE] = (tl & tr & ~bl & ~br) | (bl & br & ~tl & ~tr) | (tl & bl & ~tr & ~br) | (tr & br & ~tl & ~bl);
+		masks[BLOCK_DIAGONAL] = (tl & br & ~tr & ~bl) | (tr & bl & ~tl & ~br);
+		masks[BLOCK_ONE] = (tl ^ tr ^ bl ^ br) & ~masks[BLOCK_THREE];
+
+		uint64_t inTop = tl | tr;
+		for (int c=0;c<NUM_BLOCK_CLASSES;c++)
+		{
+			topMasks[c][i] = masks[c] & inTop;
+			bottomMasks[c][i] = masks[c] & ~inTop;
+		}
+	}
+}
+
+/*
+ * Copies row y of a plane, clearing the pixels on the border of the plane
+ */
+static void loadRow(const BitPlane& plane, int y, uint64_t *dst)
+{
+	int n = plane.wordsPerRow;
+	if (y <= 0 || y >= plane.rows - 1)
+	{
+		for (int i=0;i<n;i++)
+			dst[i] = 0;
+		return;
+	}
+
+	const uint64_t *src = plane.row(y);
+	for (int i=0;i<n;i++)
+		dst[i] = src[i];
+	dst[0] &= ~1ULL;
+	dst[(plane.cols - 1) >> 6] &= ~(1ULL << ((plane.cols - 1) & 63));
+}
+
+/*
+ * Finds the first pixel at or after x which is set (or clear if set is false),
+ * or n * 64 if there is none
+ */
+static int findPixel(const uint64_t *row, int n, int x, bool set)
+{
+	int i = x >> 6;
+	if (i >= n)
+		return n * 64;
+	uint64_t word = (set ? row[i] : ~row[i]) & (~0ULL << (x & 63));
+	while (word == 0)
+	{
+		if (++i >= n)
+			return n * 64;
+		word = set ? row[i] : ~row[i];
+	}
+	return i * 64 + __builtin_ctzll(word);
+}
+
+static int findRoot(vector<int>& parent, int i)
+{
+	while (parent[i] != i)
+	{
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+static void unite(vector<int>& parent, int a, int b)
+{
+	a = findRoot(parent, a);
+	b = findRoot(parent, b);
+
+	// Keep the earlier run as the root, so components are numbered in scan order
+	if (a < b)
+		parent[b] = a;
+	else if (b < a)
+		parent[a] = b;
+}
+
+/*
+ * Compares the row of a run, given by its index, with a row
+ */
+struct RunAboveRow
+{
+	RunAboveRow(const vector<ComponentRun>& runs) : runs(runs) {
+	}
+
+	bool operator()(int run, int y) const {
+		return runs[run].y < y;
+	}
+
+	const vector<ComponentRun>& runs;
+};
+
+/*
+ * Measures a component with holes by tracing it, and marks the components
+ * within its holes as nested
+ */
+static void traceComponent(int index, const vector<ComponentRun>& runs, const vector<int>& firstRuns,
+	vector<Component>& components)
+{
+	Component& comp = components[index];
+
+	// Draw the component alone, with a clear border around it
+	Rect roi(comp.bounds.x - 1, comp.bounds.y - 1, comp.bounds.width + 2, comp.bounds.height + 2);
+	Mat mask(roi.size(), CV_8U, Scalar(0));
+	for (int r=firstRuns[index];r<runs.size();r++)
+	{
+		const ComponentRun& run = runs[r];
+		if (run.y >= comp.bounds.br().y)
+			break;
+		if (run.component == index)
+			mask.row(run.y - roi.y).colRange(run.start - roi.x, run.end - roi.x).setTo(Scalar(255));
+	}
+
+	vector<vector<Point> > contours;
+	vector<Vec4i> hierarchy;
+	findContours(mask, contours, hierarchy, CV_RETR_CCOMP, CV_CHAIN_APPROX_NONE);
+
+	for (int i=0;i<contours.size();i++)
+	{
+		// Outer contour
+		if (hierarchy[i][3] < 0)
+		{
+			comp.area = contourArea(contours[i]);
+			comp.perimeter = arcLength(contours[i], true);
+			continue;
+		}
+
+		// Hole, which hides any component within it. Components are numbered in scan
+		// order, so only those whose first run is in the rows of the hole are checked
+		Rect holeBounds = boundingRect(contours[i]) + roi.tl();
+		int j = lower_bound(firstRuns.begin(), firstRuns.end(), holeBounds.y, RunAboveRow(runs)) - firstRuns.begin();
+		for (;j<components.size() && runs[firstRuns[j]].y < holeBounds.br().y;j++)
+		{
+			if (j == index || components[j].nested || (components[j].bounds & holeBounds) != components[j].bounds)
+				continue;
+			const ComponentRun& first = runs[firstRuns[j]];
+			if (pointPolygonTest(contours[i], Point2f(first.start - roi.x, first.y - roi.y), false) > 0)
+				components[j].nested = true;
+		}
+	}
+}
+
+void ComponentLabeler::label(const BitPlane& plane, vector<Component>& components, vector<ComponentRun> *runsOut)
+{
+	components.clear();
+	int n = plane.wordsPerRow;
+
+	vector<ComponentRun>& runs = runsOut ? *runsOut : localRuns;
+	runs.clear();
+	sums.clear();
+	parent.clear();
+	if (plane.rows < 3 || plane.cols < 3)
+		return;
+
+	// Current row and the one below it, blocks between them with a pixel in the
+	// current row, and those without, for both this row and the one above
+	rowBuf.assign(n * 2, 0);
+	maskBuf.assign(n * NUM_BLOCK_CLASSES * 3, 0);
+	uint64_t *current = &rowBuf[0], *below = &rowBuf[n];
+	uint64_t *topMasks[NUM_BLOCK_CLASSES], *aboveMasks[NUM_BLOCK_CLASSES], *belowMasks[NUM_BLOCK_CLASSES];
+	for (int c=0;c<NUM_BLOCK_CLASSES;c++)
+	{
+		topMasks[c] = &maskBuf[c * n];
+		aboveMasks[c] = &maskBuf[(NUM_BLOCK_CLASSES + c) * n];
+		belowMasks[c] = &maskBuf[(NUM_BLOCK_CLASSES * 2 + c) * n];
+	}
+
+	// Blocks between the first row, which is border, and the second
+	loadRow(plane, 1, below);
+	classifyBlocks(current, below, n, topMasks, belowMasks);
+
+	int prevStart = 0, prevEnd = 0;
+	for (int y=1;y<plane.rows-1;y++)
+	{
+		swap(current, below);
+		loadRow(plane, y + 1, below);
+		for (int c=0;c<NUM_BLOCK_CLASSES;c++)
+			swap(aboveMasks[c], belowMasks[c]);
+		classifyBlocks(current, below, n, topMasks, belowMasks);
+
+		// Find runs of this row. Blocks j covering one of its pixels (j-1 or j) and
+		// assigned to this row belong to it
+		int rowStart = runs.size();
+		int x = findPixel(current, n, 0, true);
+		while (x < plane.cols)
+		{
+			int end = findPixel(current, n, x, false);
+			ComponentRun run = { y, x, end, 0 };
+			runs.push_back(run);
+			parent.push_back(runs.size() - 1);
+
+			BlockSums runSums = { 0, 0, 0, 0 };
+			addBlocks(topMasks, x, end, runSums);
+			addBlocks(aboveMasks, x, end, runSums);
+			sums.push_back(runSums);
+
+			x = findPixel(current, n, end, true);
+		}
+		int rowEnd = runs.size();
+
+		// Join with the 8-connected runs of the row above
+		int p = prevStart;
+		for (int r=rowStart;r<rowEnd;r++)
+		{
+			while (p < prevEnd && runs[p].end < runs[r].start)
+				p++;
+			for (int q=p;q<prevEnd && runs[q].start <= runs[r].end;q++)
+				unite(parent, r, q);
+		}
+		prevStart = rowStart;
+		prevEnd = rowEnd;
+	}
+
+	// Add up the runs of each component. A root is the first run of its component
+	firstRuns.clear();
+	componentSums.clear();
+	sumX.clear();
+	sumY.clear();
+	for (int r=0;r<runs.size();r++)
+	{
+		ComponentRun& run = runs[r];
+		int root = findRoot(parent, r);
+		if (root == r)
+		{
+			run.component = components.size();
+			Component comp;
+			comp.pixels = 0;
+			comp.bounds = Rect(run.start, run.y, 0, 0);
+			comp.nested = false;
+			components.push_back(comp);
+			firstRuns.push_back(r);
+			BlockSums zero = { 0, 0, 0, 0 };
+			componentSums.push_back(zero);
+			sumX.push_back(0);
+			sumY.push_back(0);
+		}
+		else
+			run.component = runs[root].component;
+
+		int c = run.component;
+		Component& comp = components[c];
+		int length = run.end - run.start;
+		comp.pixels += length;
+		sumX[c] += (run.start + run.end - 1) * 0.5 * length;
+		sumY[c] += (double)run.y * length;
+		comp.bounds |= Rect(run.start, run.y, length, 1);
+
+		componentSums[c].area2 += sums[r].area2;
+		componentSums[c].sides += sums[r].sides;
+		componentSums[c].diagonals += sums[r].diagonals;
+		componentSums[c].euler4 += sums[r].euler4;
+	}
+
+	holed.clear();
+	for (int c=0;c<components.size();c++)
+	{
+		Component& comp = components[c];
+		comp.centroid = Point2d(sumX[c] / comp.pixels, sumY[c] / comp.pixels);
+		comp.area = componentSums[c].area2 * 0.5;
+		comp.perimeter = componentSums[c].sides + componentSums[c].diagonals * sqrt(2.0);
+
+		// Euler number below one means holes
+		if (componentSums[c].euler4 < 4)
+			holed.push_back(c);
+	}
+
+	for (int i=0;i<holed.size();i++)
+		traceComponent(holed[i], runs, firstRuns, components);
+}
+
+void labelComponents(const BitPlane& plane, vector<Component>& components, vector<ComponentRun> *runs)
+{
+	ComponentLabeler labeler;
+	labeler.label(plane, components, runs);
+}
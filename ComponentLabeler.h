@@ -0,0 +1,80 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+#include "BitPlane.h"
+
+/*
+ * Labels the 8-connected components of a bit plane in a single pass over its
+ * rows, working on runs of set pixels joined with union-find. Descriptors of
+ * each component are added up as the rows are passed, so no boundary point
+ * lists are made.
+ *
+ * Area and perimeter are those of the outer contour that findContours
+ * (CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE) traces, as contourArea and arcLength
+ * give them. They are found by classifying every 2x2 block of pixels: within a
+ * block, the contour through the pixel centers either covers the whole block,
+ * half of it cut by a diagonal, or only runs along its sides. Components with
+ * holes are measured by tracing them, as holes are not part of the outer contour.
+ */
+
+// Run of set pixels [start, end) in row y, and the component it belongs to
+struct ComponentRun
+{
+	int y;
+	int start;
+	int end;
+	int component;
+};
+
+struct Component
+{
+	int pixels;					// Number of set pixels
+	double area;				// Area within the outer contour, as contourArea
+	double perimeter;			// Length of the outer contour, as arcLength
+	cv::Point2d centroid;		// Mean position of the pixels
+	cv::Rect bounds;			// Bounding box of the pixels
+
+	// True if the component lies within a hole of another one, so findContours
+	// would not give it an outer contour
+	bool nested;
+};
+
+/*
+ * Labels components, keeping its buffers between planes so that labelling
+ * allocates nothing once they are sized (apart from tracing components with
+ * holes)
+ */
+class ComponentLabeler
+{
+public:
+	// Labels the components of a plane. Pixels on the border of the plane are
+	// ignored, as findContours does. If runs is given, it receives all runs of set
+	// pixels in row order, for drawing components.
+	void label(const BitPlane& plane, std::vector<Component>& components,
+		std::vector<ComponentRun> *runs = NULL);
+
+	// Sums over the 2x2 blocks of pixels assigned to a run. See ComponentLabeler.cpp
+	struct BlockSums
+	{
+		int area2;			// Area covered in half blocks
+		int sides;			// Steps of length 1 along sides not covered
+		int diagonals;		// Steps of length sqrt(2) across diagonals
+		int euler4;			// Four times the Euler number (components minus holes)
+	};
+
+private:
+	std::vector<ComponentRun> localRuns;
+	std::vector<BlockSums> sums;
+	std::vector<int> parent;
+	std::vector<uint64_t> rowBuf, maskBuf;
+	std::vector<int> firstRuns;
+	std::vector<BlockSums> componentSums;
+	std::vector<double> sumX, sumY;
+	std::vector<int> holed;
+};
+
+// Labels the components of a plane with a new ComponentLabeler
+void labelComponents(const BitPlane& plane, std::vector<Component>& components,
+	std::vector<ComponentRun> *runs = NULL);
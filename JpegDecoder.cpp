@@ -0,0 +1,199 @@
+#include "stdafx.h"
+#include "JpegDecoder.h"
+
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace cv;
+using namespace std;
+
+/*
+ * libjpeg-turbo can output BGR directly (JCS_EXTENSIONS) and, since 1.5, crop and
+ * skip scanlines. With plain libjpeg, RGB is swapped to BGR after decoding and
+ * regions are cut out of whole decoded rows instead.
+ */
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define JPEG_CROP_SCANLINES
+#endif
+
+/*
+ * Error handling for libjpeg, which by default exits the process on errors.
+ * Errors jump back to the function which set jump instead.
+ */
+struct JpegErrorManager
+{
+	jpeg_error_mgr pub;
+	jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+	longjmp(((JpegErrorManager*)cinfo->err)->jump, 1);
+}
+
+static void jpegOutputMessage(j_common_ptr cinfo)
+{
+	// Warnings about corrupt data are not of interest
+}
+
+JpegDecoder::JpegDecoder(void)
+{
+}
+
+bool JpegDecoder::load(const string& path)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+
+	vector<uchar> fileData;
+	uchar buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+		fileData.insert(fileData.end(), buf, buf + n);
+	fclose(file);
+
+	return setData(fileData);
+}
+
+bool JpegDecoder::setData(const vector<uchar>& data)
+{
+	this->data = data;
+	imageSize = Size();
+	decoded.release();
+
+	// Check for the start of image marker before handing it to libjpeg
+	if (data.size() < 4 || data[0] != 0xFF || data[1] != 0xD8)
+		return false;
+
+	jpeg_decompress_struct cinfo;
+	JpegErrorManager err;
+	cinfo.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = jpegErrorExit;
+	err.pub.output_message = jpegOutputMessage;
+
+	if (setjmp(err.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		imageSize = Size();
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, &this->data[0], this->data.size());
+	jpeg_read_header(&cinfo, TRUE);
+	imageSize = Size(cinfo.image_width, cinfo.image_height);
+	jpeg_destroy_decompress(&cinfo);
+
+	return imageSize.area() > 0;
+}
+
+Size JpegDecoder::size() const
+{
+	return imageSize;
+}
+
+int JpegDecoder::scaleForSize(int minSize) const
+{
+	int scale = 8;
+	while (scale > 1 && max(imageSize.width, imageSize.height) / scale < minSize)
+		scale /= 2;
+	return scale;
+}
+
+Mat JpegDecoder::decodeScaled(int scale)
+{
+	if (!decode(scale, Rect()))
+		return Mat();
+	return decoded;
+}
+
+Mat JpegDecoder::decodeRegion(Rect roi)
+{
+	if (roi.area() == 0 || (roi & Rect(Point(0, 0), imageSize)) != roi)
+		return Mat();
+	if (!decode(1, roi))
+		return Mat();
+	return decoded;
+}
+
+bool JpegDecoder::decode(int scale, Rect roi)
+{
+	// Decoded image is kept in a member, as locals are unreliable after longjmp
+	decoded.release();
+	if (imageSize.area() == 0)
+		return false;
+
+	jpeg_decompress_struct cinfo;
+	JpegErrorManager err;
+	cinfo.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = jpegErrorExit;
+	err.pub.output_message = jpegOutputMessage;
+
+	if (setjmp(err.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		decoded.release();
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, &data[0], data.size());
+	jpeg_read_header(&cinfo, TRUE);
+
+	// Scale while decoding the DCT blocks and output BGR as OpenCV does
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = scale;
+#ifdef JCS_EXTENSIONS
+	cinfo.out_color_space = JCS_EXT_BGR;
+#else
+	cinfo.out_color_space = JCS_RGB;
+#endif
+	jpeg_start_decompress(&cinfo);
+
+	if (roi.area() == 0)
+	{
+		decoded.create(cinfo.output_height, cinfo.output_width, CV_8UC3);
+		while (cinfo.output_scanline < cinfo.output_height)
+		{
+			JSAMPROW row = decoded.ptr<uchar>(cinfo.output_scanline);
+			jpeg_read_scanlines(&cinfo, &row, 1);
+		}
+		jpeg_finish_decompress(&cinfo);
+	}
+	else
+	{
+#ifdef JPEG_CROP_SCANLINES
+		// Columns can only be cropped to whole blocks, so decode a few extra
+		JDIMENSION x = roi.x, width = roi.width;
+		jpeg_crop_scanline(&cinfo, &x, &width);
+
+		decoded.create(roi.height, width, CV_8UC3);
+		jpeg_skip_scanlines(&cinfo, roi.y);
+#else
+		// Decode whole rows, reading the rows above the region into the first one
+		JDIMENSION x = 0;
+		decoded.create(roi.height, cinfo.output_width, CV_8UC3);
+		while (cinfo.output_scanline < (JDIMENSION)roi.y)
+		{
+			JSAMPROW row = decoded.ptr<uchar>(0);
+			jpeg_read_scanlines(&cinfo, &row, 1);
+		}
+#endif
+		for (int y=0;y<roi.height;y++)
+		{
+			JSAMPROW row = decoded.ptr<uchar>(y);
+			jpeg_read_scanlines(&cinfo, &row, 1);
+		}
+		decoded = decoded(Rect(roi.x - x, 0, roi.width, roi.height));
+
+		// Rows below the region are not needed
+		jpeg_abort_decompress(&cinfo);
+	}
+	jpeg_destroy_decompress(&cinfo);
+
+#ifndef JCS_EXTENSIONS
+	cvtColor(decoded, decoded, CV_RGB2BGR);
+#endif
+
+	return true;
+}
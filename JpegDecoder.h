@@ -0,0 +1,50 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <string>
+#include <vector>
+
+/*
+ * Decodes JPEG images with libjpeg(-turbo), either at a reduced size by scaling
+ * in the DCT domain or only within a region. This avoids decoding the full 
+ * image when only a thumbnail or the part around the dish is needed.
+ *
+ * Usage:
+ *  load(...) or setData(...)
+ *  decodeScaled(...) and/or decodeRegion(...)
+ */
+class JpegDecoder
+{
+public:
+	JpegDecoder(void);
+
+	// Reads a file and its JPEG header. Returns false if it is not a JPEG image
+	bool load(const std::string& path);
+
+	// Takes encoded data and reads its JPEG header. Returns false if it is not a JPEG image
+	bool setData(const std::vector<uchar>& data);
+
+	// Full size of the image
+	cv::Size size() const;
+
+	// Gets the largest scale (1, 2, 4 or 8) at which the largest side of the image
+	// is still at least minSize
+	int scaleForSize(int minSize) const;
+
+	// Decodes the whole image at 1/scale of its size (scale is 1, 2, 4 or 8).
+	// Returns an empty image on errors
+	cv::Mat decodeScaled(int scale);
+
+	// Decodes only a region of the image at full size. Returns an empty image on
+	// errors or if the region is not within the image
+	cv::Mat decodeRegion(cv::Rect roi);
+
+private:
+	// Decodes the image at 1/scale of its size, keeping only roi (of the scaled
+	// image) if it is not empty, into decoded
+	bool decode(int scale, cv::Rect roi);
+
+	std::vector<uchar> data;
+	cv::Size imageSize;
+	cv::Mat decoded;
+};
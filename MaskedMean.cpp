@@ -0,0 +1,155 @@
+#include "stdafx.h"
+#include <opencv2/core/core.hpp>
+#include "MaskedMean.h"
+#include "Parallel.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Adds (sign 1) or removes (sign -1) the masked pixels of a row to the
+ * column sums and counts
+ */
+static inline void addRow(const unsigned char *img, const unsigned char *mask, int cols, 
+	int sign, int *colSum, int *colCnt)
+{
+	for (int x=0;x<cols;x++)
+	{
+		if (mask[x])
+		{
+			colCnt[x] += sign;
+			colSum[x*3] += sign * img[x*3];
+			colSum[x*3+1] += sign * img[x*3+1];
+			colSum[x*3+2] += sign * img[x*3+2];
+		}
+	}
+}
+
+/*
+ * Divides a sum by a count, rounding halves to even like cvRound
+ */
+static inline unsigned char roundedMean(int64 sum, int cnt)
+{
+	int64 q = sum / cnt;
+	int64 r2 = (sum - q * cnt) * 2;
+	if (r2 > cnt || (r2 == cnt && (q & 1)))
+		q++;
+	return (unsigned char)q;
+}
+
+void maskedMeanRows(const unsigned char *img, size_t imgStep, const unsigned char *mask, size_t maskStep,
+	int rows, int cols, int blurSize, unsigned char *dst, size_t dstStep, int y0, int y1, int *sums)
+{
+	// Window is [y - before, y + after], centered as boxFilter does
+	int before = blurSize / 2;
+	int after = blurSize - 1 - before;
+
+	// Sums of each column (and channel) over the rows of the window
+	vector<int> localSums;
+	if (!sums)
+	{
+		localSums.resize(cols * 4);
+		sums = &localSums[0];
+	}
+	int *colSum = sums;
+	int *colCnt = sums + cols * 3;
+	for (int i=0;i<cols*4;i++)
+		sums[i] = 0;
+
+	for (int y=max(0, y0 - before);y<=min(rows - 1, y0 + after);y++)
+		addRow(img + y * imgStep, mask + y * maskStep, cols, 1, colSum, colCnt);
+
+	for (int y=y0;y<y1;y++)
+	{
+		// Slide window along the row
+		int64 sum0 = 0, sum1 = 0, sum2 = 0;
+		int cnt = 0;
+		for (int x=0;x<=min(cols - 1, after);x++)
+		{
+			sum0 += colSum[x*3];
+			sum1 += colSum[x*3+1];
+			sum2 += colSum[x*3+2];
+			cnt += colCnt[x];
+		}
+
+		unsigned char *out = dst + y * dstStep;
+		for (int x=0;x<cols;x++)
+		{
+			if (cnt > 0)
+			{
+				out[x*3] = roundedMean(sum0, cnt);
+				out[x*3+1] = roundedMean(sum1, cnt);
+				out[x*3+2] = roundedMean(sum2, cnt);
+			}
+			else
+				out[x*3] = out[x*3+1] = out[x*3+2] = 0;
+
+			int leaving = x - before;
+			if (leaving >= 0)
+			{
+				sum0 -= colSum[leaving*3];
+				sum1 -= colSum[leaving*3+1];
+				sum2 -= colSum[leaving*3+2];
+				cnt -= colCnt[leaving];
+			}
+			int entering = x + after + 1;
+			if (entering < cols)
+			{
+				sum0 += colSum[entering*3];
+				sum1 += colSum[entering*3+1];
+				sum2 += colSum[entering*3+2];
+				cnt += colCnt[entering];
+			}
+		}
+
+		// Slide window down
+		if (y - before >= 0)
+			addRow(img + (y - before) * imgStep, mask + (y - before) * maskStep, cols, -1, colSum, colCnt);
+		if (y + after + 1 < rows)
+			addRow(img + (y + after + 1) * imgStep, mask + (y + after + 1) * maskStep, cols, 1, colSum, colCnt);
+	}
+}
+
+/*
+ * Computes the masked mean of a band of rows
+ */
+class MaskedMeanBody : public ParallelLoopBody
+{
+public:
+	MaskedMeanBody(const Mat& img, const Mat& mask, int blurSize, Mat& dst, int numThreads,
+		vector<vector<int> > *bandSums) :
+		img(img), mask(mask), blurSize(blurSize), dst(dst), numThreads(numThreads), bandSums(bandSums) {
+	}
+
+	void operator()(const Range& range) const {
+		int *sums = NULL;
+		if (bandSums)
+		{
+			vector<int>& band = (*bandSums)[bandIndex(range.start, img.rows, numThreads)];
+			if (band.size() < img.cols * 4)
+				band.resize(img.cols * 4);
+			sums = &band[0];
+		}
+		maskedMeanRows(img.data, img.step, mask.data, mask.step, img.rows, img.cols, blurSize,
+			dst.data, dst.step, range.start, range.end, sums);
+	}
+
+private:
+	const Mat& img;
+	const Mat& mask;
+	int blurSize;
+	Mat& dst;
+	int numThreads;
+	vector<vector<int> > *bandSums;
+};
+
+void maskedMean(const Mat& img, const Mat& mask, int blurSize, Mat& dst, int numThreads,
+	vector<vector<int> > *bandSums)
+{
+	assert(img.type() == CV_8UC3 && mask.type() == CV_8UC1 && img.size() == mask.size());
+
+	dst.create(img.size(), CV_8UC3);
+	if (bandSums && bandSums->size() < bandCount(img.rows, numThreads))
+		bandSums->resize(bandCount(img.rows, numThreads));
+	parallelForBands(img.rows, numThreads, MaskedMeanBody(img, mask, blurSize, dst, numThreads, bandSums));
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+/*
+ * Box filter that averages only the pixels within a mask, as used to estimate
+ * the background of a plate. Keeps running sums of columns instead of full
+ * size 32-bit images, so memory use is a few rows of sums per thread.
+ */
+
+// Computes, for rows [y0, y1) of a BGR image, the mean of the masked pixels in
+// the blurSize x blurSize window around each pixel (0 if there are none).
+// Works on raw rows so that it can be run on bands of an image. sums, if given,
+// is room for cols * 4 column sums, which are otherwise allocated.
+void maskedMeanRows(const unsigned char *img, size_t imgStep, const unsigned char *mask, size_t maskStep,
+	int rows, int cols, int blurSize, unsigned char *dst, size_t dstStep, int y0, int y1, int *sums = NULL);
+
+// Computes the masked mean of a BGR image using numThreads bands of rows.
+// img and dst are CV_8UC3, mask is CV_8UC1 with non-zero for pixels to include.
+// bandSums, if given, keeps the column sums of each band for the next call.
+void maskedMean(const cv::Mat& img, const cv::Mat& mask, int blurSize, cv::Mat& dst, int numThreads,
+	std::vector<std::vector<int> > *bandSums = NULL);
@@ -3,6 +3,9 @@
 using namespace cv;
 using namespace std;
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
 
 #pragma once
 
@@ -25,11 +28,49 @@ public:
 	// If supported, display the image specified to the screen
 	virtual void updateScreen(Mat& screen) = 0;
 
+	// Check if images passed to updateScreen are used. If not, the algorithm
+	// does not make images only meant for display
+	virtual bool wantsImages() { return true; }
+
+	// If supported, give the user time to see the results before finishing
+	virtual void showResults() {}
+
 	// If supported, log the specified message
 	virtual void log(string msg) = 0;
 
 	// Check if the user has aborted the operation
 	virtual bool isAborted() = 0;
+
+	// If supported, record the start and end of a stage of the algorithm for
+	// profiling. Stages may nest, and are ended in the reverse order of starting.
+	// Names are string literals, so they may be kept without copying
+	virtual void beginStage(const char *name) {}
+	virtual void endStage(const char *name) {}
+
+	// If supported, record a value measured by the algorithm, such as a count
+	virtual void counter(const char *name, double value) {}
+};
+
+/*
+ * Records a stage on a context, if any, from construction until destruction,
+ * so that the stage is ended on every return
+ */
+class ContextStage {
+public:
+	ContextStage(OpenCVActivityContext *context, const char *name) :
+		context(context), name(name) {
+		if (context)
+			context->beginStage(name);
+	}
+
+	~ContextStage() {
+		if (context)
+			context->endStage(name);
+	}
+
+private:
+	OpenCVActivityContext *context;
+	const char *name;
 };
 
 /*
@@ -38,10 +79,11 @@ public:
 class ConsoleOpenCVActivityContext : public OpenCVActivityContext {
 public:
 	ConsoleOpenCVActivityContext(int argc, char* argv[], bool logging) :
-		argc(argc), argv(argv), logging(logging) {
+		argc(argc), argv(argv), logging(logging), traceStart(0) {
 	}
 
 	~ConsoleOpenCVActivityContext() {
+		writeTrace();
 	}
 
 	string getParam(int n) {
@@ -59,6 +101,10 @@ public:
 	void updateScreen(Mat& screen) {
 	}
 
+	bool wantsImages() {
+		return false;
+	}
+
 	void log(string msg) {
 		if (logging)
 			printf("%s\n", msg.c_str());
@@ -68,12 +114,99 @@ public:
 		return false;
 	}
 
+	void beginStage(const char *name) {
+		addTraceEvent(name, 'B', 0);
+	}
+
+	void endStage(const char *name) {
+		addTraceEvent(name, 'E', 0);
+	}
+
+	void counter(const char *name, double value) {
+		addTraceEvent(name, 'C', value);
+	}
+
+	// Records stages and counters, writing them to path as a Chrome trace (as
+	// shown by chrome://tracing or Perfetto) when the context is destroyed
+	void traceTo(const string& path) {
+		tracePath = path;
+		traceEvents.clear();
+		traceStart = (double)getTickCount();
+	}
+
+	// Traces to a new file in the directory named by the EC_PLATES_TRACE
+	// environment variable, if it is set
+	void traceFromEnvironment() {
+		static int traceCount = 0;
+		const char *dir = getenv("EC_PLATES_TRACE");
+		if (dir && *dir)
+			traceTo(format("%s/trace-%d-%d.json", dir, (int)getpid(), __sync_fetch_and_add(&traceCount, 1)));
+	}
+
 	string returnValue;
 
 private:
 	int argc;
 	char** argv;
 	bool logging;
+
+	struct TraceEvent {
+		const char *name;
+		char phase;			// B(egin), E(nd) or C(ounter)
+		double time;		// Microseconds since tracing started
+		double value;		// Value of a counter
+	};
+
+	string tracePath;
+	vector<TraceEvent> traceEvents;
+	double traceStart;
+
+	void addTraceEvent(const char *name, char phase, double value) {
+		if (tracePath.empty())
+			return;
+		TraceEvent event;
+		event.name = name;
+		event.phase = phase;
+		event.time = ((double)getTickCount() - traceStart) * 1e6 / getTickFrequency();
+		event.value = value;
+		traceEvents.push_back(event);
+	}
+
+	// Writes the trace file, in the JSON object format of the trace event format
+	void writeTrace() {
+		if (tracePath.empty())
+			return;
+		FILE *file = fopen(tracePath.c_str(), "w");
+		if (!file)
+			return;
+
+		fprintf(file, "{\"traceEvents\": [");
+		for (int i=0;i<traceEvents.size();i++)
+		{
+			const TraceEvent& e = traceEvents[i];
+			fprintf(file, "%s\n{\"name\": \"%s\", \"cat\": \"ecplates\", \"ph\": \"%c\", \"ts\": %.1f, \"pid\": %d, \"tid\": 1",
+				i > 0 ? "," : "", e.name, e.phase, e.time, (int)getpid());
+			if (e.phase == 'C')
+				fprintf(file, ", \"args\": {\"value\": %g}", e.value);
+			fprintf(file, "}");
+		}
+		fprintf(file, "\n],\n\"otherData\": {\"image\": \"");
+
+		// Image the trace is for, escaped as a JSON string
+		string image = argc > 0 ? argv[0] : "";
+		for (int i=0;i<image.size();i++)
+		{
+			unsigned char c = image[i];
+			if (c == '"' || c == '\\')
+				fprintf(file, "\\%c", c);
+			else if (c < 0x20)
+				fprintf(file, "\\u%04x", c);
+			else
+				fputc(c, file);
+		}
+		fprintf(file, "\"}}\n");
+		fclose(file);
+	}
 };
 
 /*
@@ -105,6 +238,10 @@ public:
 		waitKey(0);
 	}
 
+	void showResults() {
+		sleep(2);
+	}
+
 	void log(string msg) {
 		printf("%s\n", msg.c_str());
 	}
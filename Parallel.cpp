@@ -0,0 +1,209 @@
+#include "stdafx.h"
+#include <pthread.h>
+#include <stdexcept>
+#include <opencv2/core/core.hpp>
+#include "Parallel.h"
+
+using namespace cv;
+using namespace std;
+
+int defaultThreadCount()
+{
+	return getNumberOfCPUs();
+}
+
+/*
+ * Bands are run by a pool of threads which is started as bands need it and kept
+ * for the life of the process, so that once it has grown, running bands starts
+ * no threads and allocates nothing. Bands wait in a queue which is linked through
+ * the bands themselves, kept on the stack of the call they belong to. Calls run
+ * their first band themselves and then help with queued bands until all of theirs
+ * are done, so bands run even when the pool is busy with other calls. An exception
+ * thrown by a band is copied and thrown again by its call once all bands are done.
+ */
+
+// Exception thrown by a band, copied so that the call can throw it again
+struct BandError
+{
+	enum Kind { NONE, CV_EXCEPTION, STD_EXCEPTION, UNKNOWN };
+
+	Kind kind;
+	Exception cvError;		// Copy of a cv::Exception
+	string message;			// what() of another std::exception
+
+	BandError() : kind(NONE) {}
+
+	void rethrow() const
+	{
+		if (kind == CV_EXCEPTION)
+			throw cvError;
+		if (kind == STD_EXCEPTION)
+			throw runtime_error(message);
+		throw runtime_error("Unknown exception in parallel band");
+	}
+};
+
+// Work for one band
+struct BandTask
+{
+	const ParallelLoopBody *body;
+	Range range;
+	int *pending;			// Bands of the call which have not finished
+	BandError *error;		// First exception thrown by the queued bands of the call
+	BandTask *next;			// Next band in the queue
+};
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bandQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bandFinished = PTHREAD_COND_INITIALIZER;
+static BandTask *queueHead = NULL, *queueTail = NULL;
+static int poolThreads = 0;
+
+// Takes the first band from the queue, if any. poolMutex must be held
+static BandTask *takeBand()
+{
+	BandTask *task = queueHead;
+	if (task)
+	{
+		queueHead = task->next;
+		if (!queueHead)
+			queueTail = NULL;
+	}
+	return task;
+}
+
+// Runs body over range, copying any exception it throws into error
+static void runCaught(const ParallelLoopBody& body, const Range& range, BandError& error)
+{
+	try {
+		body(range);
+	}
+	catch (Exception& e) {
+		error.kind = BandError::CV_EXCEPTION;
+		error.cvError = e;
+	}
+	catch (std::exception& e) {
+		error.kind = BandError::STD_EXCEPTION;
+		error.message = e.what();
+	}
+	catch (...) {
+		error.kind = BandError::UNKNOWN;
+	}
+}
+
+// Runs a band taken from the queue, releasing poolMutex while it runs. The band
+// must not be used once it is marked finished, as its call may then return
+static void runBand(BandTask *task)
+{
+	pthread_mutex_unlock(&poolMutex);
+	BandError error;
+	runCaught(*task->body, task->range, error);
+	pthread_mutex_lock(&poolMutex);
+	if (error.kind != BandError::NONE && task->error->kind == BandError::NONE)
+		*task->error = error;
+	if (--*task->pending == 0)
+		pthread_cond_broadcast(&bandFinished);
+}
+
+static void *poolThread(void *)
+{
+	pthread_mutex_lock(&poolMutex);
+	while (true)
+	{
+		BandTask *task = takeBand();
+		if (task)
+			runBand(task);
+		else
+			pthread_cond_wait(&bandQueued, &poolMutex);
+	}
+	return NULL;
+}
+
+// Runs queued bands until the bands of a call have finished
+static void finishBands(int& pending)
+{
+	pthread_mutex_lock(&poolMutex);
+	while (pending > 0)
+	{
+		BandTask *task = takeBand();
+		if (task)
+			runBand(task);
+		else
+			pthread_cond_wait(&bandFinished, &poolMutex);
+	}
+	pthread_mutex_unlock(&poolMutex);
+}
+
+int bandCount(int count, int numThreads)
+{
+	if (numThreads <= 0)
+		numThreads = defaultThreadCount();
+	if (numThreads > count)
+		numThreads = count;
+	return min(max(numThreads, 1), PARALLEL_MAX_BANDS);
+}
+
+int bandIndex(int start, int count, int numThreads)
+{
+	// Band i starts at count * i / numThreads, rounded down
+	numThreads = bandCount(count, numThreads);
+	return (int)(((long)start * numThreads + count - 1) / max(count, 1));
+}
+
+void parallelForBands(int count, int numThreads, const ParallelLoopBody& body)
+{
+	numThreads = bandCount(count, numThreads);
+
+	if (numThreads == 1)
+	{
+		if (count > 0)
+			body(Range(0, count));
+		return;
+	}
+
+	// Split into bands that differ in size by at most one
+	BandTask tasks[PARALLEL_MAX_BANDS];
+	int pending = numThreads - 1;
+	BandError queuedError;
+	for (int i=0;i<numThreads;i++)
+	{
+		tasks[i].body = &body;
+		tasks[i].range = Range((int)((long)count * i / numThreads), (int)((long)count * (i + 1) / numThreads));
+		tasks[i].pending = &pending;
+		tasks[i].error = &queuedError;
+		tasks[i].next = i + 1 < numThreads ? &tasks[i + 1] : NULL;
+	}
+
+	pthread_mutex_lock(&poolMutex);
+
+	// Grow the pool to a thread for each band but the first. If a thread cannot be
+	// started, its bands are run by the calls instead
+	while (poolThreads < numThreads - 1)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, poolThread, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		poolThreads++;
+	}
+
+	// Queue all bands but the first, which is run on this thread
+	if (queueTail)
+		queueTail->next = &tasks[1];
+	else
+		queueHead = &tasks[1];
+	queueTail = &tasks[numThreads - 1];
+	pthread_cond_broadcast(&bandQueued);
+	pthread_mutex_unlock(&poolMutex);
+
+	// The other bands refer to this call, so they must finish before it returns,
+	// even if a band throws
+	BandError firstError;
+	runCaught(body, tasks[0].range, firstError);
+	finishBands(pending);
+
+	if (firstError.kind != BandError::NONE)
+		firstError.rethrow();
+	if (queuedError.kind != BandError::NONE)
+		queuedError.rethrow();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+/*
+ * Simple thread support for splitting per-pixel work into bands of rows.
+ * Uses pthreads directly so that the number of bands can be chosen per call,
+ * independently of OpenCV's own thread settings.
+ */
+
+// Most bands that work is split into, however many threads are requested
+const int PARALLEL_MAX_BANDS = 64;
+
+// Number of threads to use when 0 (automatic) is requested
+int defaultThreadCount();
+
+// Runs body over the range [0, count), split into numThreads contiguous bands
+// (at most PARALLEL_MAX_BANDS) which are run concurrently. numThreads of 0 uses 
+// defaultThreadCount(), and 1 runs body over the whole range on the calling thread.
+// Bands are run by a pool of threads which grows as needed and is kept, so once it
+// has grown, nothing is allocated. If bands throw, one of their exceptions is thrown
+// again on the calling thread once all bands have finished: a cv::Exception as a copy,
+// and other exceptions as std::runtime_error with the same message.
+void parallelForBands(int count, int numThreads, const cv::ParallelLoopBody& body);
+
+// Number of bands parallelForBands splits [0, count) into for numThreads, and 
+// the index of the band which starts at start, so that bodies can keep buffers
+// for each band between calls
+int bandCount(int count, int numThreads);
+int bandIndex(int start, int count, int numThreads);
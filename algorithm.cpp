@@ -3,14 +3,20 @@
 #include "Circle.h"
 #include "CircleFinder.h"
 #include "ColonyCounter.h"
+#include "JpegDecoder.h"
 #include "OpenCVActivityContext.h"
+#include "algorithm.h"
 #include "svm_table.h"
 
-#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 
 using namespace cv;
 using namespace std;
 
+static void analysePetri(OpenCVActivityContext& context, ColonyCounter& colonyCounter, Mat petri, 
+	ColonyWorkspace *workspace);
+
 /**
  * Analyzes an EC Compact Dry Plate.
  *
@@ -23,21 +29,104 @@ using namespace std;
  * 5) Return a final count
  */
 void analyseECPlate(OpenCVActivityContext& context) {
+	context.log("Loading training");
+
+	// Create the colony counter
+	ColonyCounter colonyCounter;
+	if (!loadECPlateTraining(colonyCounter)) {
+		context.setReturnValue("{\"error\":\"Model could not be loaded\"}");
+		return;
+	}
+
+	analyseECPlate(context, colonyCounter);
+
+	context.log("Showing results");
+
+	// Pause to give the user time to see the results, if they are shown
+	context.showResults();
+
+	context.log("Done");
+}
+
+/**
+ * Analyzes an EC Compact Dry Plate with a colony counter which has already been
+ * loaded, without pausing. The colony counter is not changed, so it can be 
+ * shared by several threads analysing plates at once. Each thread can pass its
+ * own workspace, so that its buffers are reused from plate to plate.
+ */
+void analyseECPlate(OpenCVActivityContext& context, ColonyCounter& colonyCounter, ColonyWorkspace *workspace) {
+	ContextStage stage(&context, "analyseECPlate");
+
 	context.log("Reading image");
 
+	// JPEG images are decoded at reduced size to find the dish, then only 
+	// around the dish at full size
+	JpegDecoder jpeg;
+	Mat small;
+	{
+		ContextStage stage(&context, "decodeScaled");
+		if (jpeg.load(context.getParam(0)))
+			small = jpeg.decodeScaled(jpeg.scaleForSize(PETRI_SEARCH_SIZE));
+	}
+
+	if (!small.empty()) {
+		context.updateScreen(small);
+
+		context.log("Finding petri image");
+
+		// Find petri disk rectangle, in full size coordinates
+		CircleFinderParams params;
+		params.context = &context;
+		Vec3f circ = findPetriDish(small, params);
+		double scaleby = jpeg.size().width * 1.0 / small.cols;
+		Rect petriRect = petriRectFromCircle(circ * scaleby);
+
+		if (petriRect.height == 0) {
+			context.log("Circle not found");
+			context.setReturnValue("{\"error\":\"EC Plate not detected\"}");
+			return;
+		}
+
+		Mat petri;
+		{
+			ContextStage stage(&context, "decodeRegion");
+			petri = jpeg.decodeRegion(petriRect);
+		}
+		if (!petri.empty()) {
+			analysePetri(context, colonyCounter, petri, workspace);
+			return;
+		}
+	}
+
 	// Load image
-	Mat img = imread(context.getParam(0));
+	Mat img;
+	{
+		ContextStage stage(&context, "imread");
+		img = imread(context.getParam(0));
+	}
 	if (img.empty()) {
 		context.setReturnValue("{\"error\":\"Image file not found\"}");
 		return;
 	}
 
+	analyseECPlate(context, colonyCounter, img, workspace);
+}
+
+/**
+ * Analyzes an EC Compact Dry Plate image which has already been loaded, with
+ * a colony counter which has already been loaded. Output files are taken from
+ * params 1 and 2 as when the image is loaded from param 0.
+ */
+void analyseECPlate(OpenCVActivityContext& context, ColonyCounter& colonyCounter, Mat img, 
+	ColonyWorkspace *workspace) {
 	context.updateScreen(img);
 
 	context.log("Finding petri image");
 
 	// Find petri disk rectangle
-	Rect petriRect = findPetriRect(img);
+	CircleFinderParams params;
+	params.context = &context;
+	Rect petriRect = findPetriRect(img, params);
 
 	if (petriRect.height == 0) {
 		context.log("Circle not found");
@@ -45,52 +134,128 @@ void analyseECPlate(OpenCVActivityContext& context) {
 		return;
 	}
 
+	analysePetri(context, colonyCounter, img(petriRect), workspace);
+}
+
+/**
+ * Analyzes the Petri dish rectangle of an EC Compact Dry Plate image
+ */
+static void analysePetri(OpenCVActivityContext& context, ColonyCounter& colonyCounter, Mat petri, 
+	ColonyWorkspace *workspace) {
 	// Update screen
-	Mat petri = img(petriRect);
 	context.updateScreen(petri);
 
-	context.log("Loading training");
-
-	// Create the colony counter
-	ColonyCounter colonyCounter;
-	colonyCounter.loadTrainingQuantized(svmLookup, svmQuants);
+	ColonyWorkspace localWorkspace;
+	ColonyWorkspace& ws = workspace ? *workspace : localWorkspace;
 
-	context.log("Preprocessing image");
+	Mat classified = ColonyWorkspace::reuse(ws.classifiedStorage, petri.size(), CV_8U);
+	Mat debugImage;
 
-	// Preprocess image
-	petri = colonyCounter.preprocessImage(petri);
-	context.updateScreen(petri);
+	// Images for display are only made if the context shows them
+	bool showImages = context.wantsImages();
 
-	// Optionally write out preprocessed image
+	// Optionally write out preprocessed image, which needs it to be kept
 	if (context.getParamCount() >= 3) {
+		context.log("Preprocessing image");
+
+		// Preprocess image
+		{
+			ContextStage stage(&context, "preprocessImage");
+			petri = colonyCounter.preprocessImage(petri);
+		}
+		context.updateScreen(petri);
+
 		imwrite(context.getParam(2), petri);
-	}
 
-	context.log("Classifying image");
+		context.log("Classifying image");
 
-	// Classify image
-	Mat debugImage;
-	Mat classified = colonyCounter.classifyImage(petri, true, &debugImage);
-	context.updateScreen(debugImage);
+		// Classify image
+		{
+			ContextStage stage(&context, "classifyImage");
+			classified = colonyCounter.classifyImage(petri, showImages, &debugImage);
+		}
+	}
+	else {
+		context.log("Preprocessing and classifying image");
+
+		// Preprocess and classify in one pass
+		{
+			ContextStage stage(&context, "classifyPetri");
+			colonyCounter.classifyPetri(petri, classified, ws);
+		}
+		if (showImages)
+			ColonyCounter::renderClassified(classified, debugImage);
+	}
+	context.counter("petri pixels", classified.rows * classified.cols);
+	if (showImages)
+		context.updateScreen(debugImage);
 
 	context.log("Counting colonies");
 
-	// Count colonies
-	int red, blue;
-	colonyCounter.countColonies(classified, red, blue, true, &debugImage);
-	context.updateScreen(debugImage);
+	// Count colonies, drawing them if they are shown or written out
+	bool colonyImage = showImages || context.getParamCount() >= 2;
+	vector<Colony>& colonies = ws.colonies;
+	{
+		ContextStage stage(&context, "countColonies");
+		colonyCounter.countColonies(classified, colonies, ws, colonyImage, &debugImage);
+	}
+	int red = 0, blue = 0;
+	for (int i=0;i<colonies.size();i++)
+		(colonies[i].type == 1 ? red : blue)++;
+	context.counter("red colonies", red);
+	context.counter("blue colonies", blue);
+	if (showImages)
+		context.updateScreen(debugImage);
 
 	// Optionally write out colony image
 	if (context.getParamCount() >= 2) {
 		imwrite(context.getParam(1), debugImage);
 	}
 
-	context.log("Showing results");
+	context.setReturnValue(formatECPlateResult(red, blue, wantECPlateColonies() ? &colonies : NULL));
+}
 
-	// Pause to give the user time to see the results
-	sleep(2);
+/**
+ * Loads the training used for EC Compact Dry Plates: the binary model file
+ * named by the EC_PLATES_MODEL environment variable if it is set, otherwise
+ * the lookup table built into svm_table.h. Returns false if the model file
+ * could not be loaded.
+ */
+bool loadECPlateTraining(ColonyCounter& colonyCounter) {
+	const char *modelPath = getenv("EC_PLATES_MODEL");
+	if (modelPath && *modelPath)
+		return colonyCounter.loadTrainingBinary(modelPath);
 
-	context.log("Done");
+	colonyCounter.loadTrainingQuantized(svmLookup, svmQuants);
+	return true;
+}
+
+/**
+ * Checks if results should list each colony, as set by the EC_PLATES_COLONIES
+ * environment variable
+ */
+bool wantECPlateColonies() {
+	const char *colonies = getenv("EC_PLATES_COLONIES");
+	return colonies && *colonies && strcmp(colonies, "0") != 0;
+}
 
-	context.setReturnValue(format("{\"tc\": %d, \"ecoli\": %d, \"algorithm\": \"2013-03-19\"}", red, blue));
+/**
+ * Formats the result of analysing an EC Compact Dry Plate as JSON, optionally
+ * listing each colony with its class, centroid, area, circularity and bounding
+ * box in the coordinates of the colony image
+ */
+string formatECPlateResult(int red, int blue, const vector<Colony> *colonies) {
+	string result = format("{\"tc\": %d, \"ecoli\": %d, \"algorithm\": \"2013-03-19\"", red, blue);
+	if (colonies) {
+		result += ", \"colonies\": [";
+		for (int i=0;i<colonies->size();i++) {
+			const Colony& colony = (*colonies)[i];
+			result += format("%s{\"class\": \"%s\", \"x\": %.2f, \"y\": %.2f, \"area\": %.1f, \"circularity\": %.3f, "
+				"\"bounds\": [%d, %d, %d, %d]}", i > 0 ? ", " : "", colony.type == 1 ? "tc" : "ecoli", 
+				colony.centroid.x, colony.centroid.y, colony.area, colony.circularity,
+				colony.bounds.x, colony.bounds.y, colony.bounds.width, colony.bounds.height);
+		}
+		result += "]";
+	}
+	return result + "}";
 }
@@ -1,3 +1,12 @@
+#pragma once
+
 #include "OpenCVActivityContext.h"
+#include "ColonyCounter.h"
 
 void analyseECPlate(OpenCVActivityContext& context);
+void analyseECPlate(OpenCVActivityContext& context, ColonyCounter& colonyCounter, ColonyWorkspace *workspace = NULL);
+void analyseECPlate(OpenCVActivityContext& context, ColonyCounter& colonyCounter, cv::Mat img, 
+	ColonyWorkspace *workspace = NULL);
+bool loadECPlateTraining(ColonyCounter& colonyCounter);
+bool wantECPlateColonies();
+std::string formatECPlateResult(int red, int blue, const std::vector<Colony> *colonies = NULL);
@@ -0,0 +1,897 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+#include "AllocationCounter.h"
+#include "BitPlane.h"
+#include "CircleFinder.h"
+#include "ClassifyKernel.h"
+#include "ColonyCounter.h"
+#include "ComponentLabeler.h"
+#include "Parallel.h"
+#include "algorithm.h"
+#include "benchmark.h"
+#include "svm_table.h"
+
+using namespace cv;
+
+/*
+ * Benchmarks for measuring the speed of stages of the algorithm
+ * on realistically sized images.
+ */
+
+// Number of times each benchmark is repeated. The fastest run is reported
+static const int BENCH_REPEATS = 5;
+
+/*
+ * Number of heap allocations, as counted by AllocationCounter.cpp in the benchmark
+ * build. ec-plates itself does not link that in, so gets this version instead
+ */
+long __attribute__((weak)) heapAllocations()
+{
+	return -1;
+}
+
+/*
+ * Formats the number of heap allocations made since start, as read from
+ * heapAllocations, or "-" when they are not counted
+ */
+static string allocationsSince(long start)
+{
+	if (start < 0)
+		return "-";
+	char buf[32];
+	sprintf(buf, "%ld", heapAllocations() - start);
+	return buf;
+}
+
+/*
+ * Classifies an image the way classifyImage did before the row kernels:
+ * column by column, computing the SVM inputs of each pixel separately.
+ * Kept as a baseline to measure against.
+ */
+static Mat classifyColumnMajor(Mat img)
+{
+	Mat classified(img.size(), CV_8U);
+
+	for (int x=0;x<img.cols;x++)
+	{
+		for (int y=0;y<img.rows;y++)
+		{
+			Vec3b color = img.at<Vec3b>(y,x);
+			float vals[2];
+			vals[0] = ((float)color(0) + (float)color(1) + (float)color(2))/600;
+			if (vals[0] > 1)
+				vals[0] = 1;
+			if (color(0) + color(2) == 0)
+				vals[1] = 0.5f;
+			else
+				vals[1] = (float)color(2)/(float)(color(0) + color(2));
+
+			int index = round(vals[1]*(svmQuants[1]-1));
+			index *= svmQuants[0];
+			index += round(vals[0]*(svmQuants[0]-1));
+			classified.at<unsigned char>(y,x) = svmLookup[index];
+		}
+	}
+	return classified;
+}
+
+/*
+ * Loads an image and makes a preprocessed petri crop of the given size from it
+ */
+static Mat makePetriCrop(ColonyCounter& colonyCounter, const char *path, int size)
+{
+	Mat img = imread(path);
+	if (img.empty())
+		return img;
+
+	Rect petriRect = findPetriRect(img);
+	if (petriRect.height == 0)
+		return Mat();
+
+	Mat petri;
+	resize(img(petriRect), petri, Size(size, size), 0, 0, INTER_LINEAR);
+	return colonyCounter.preprocessImage(petri);
+}
+
+/*
+ * Compares the classification kernels on a 3000x3000 petri crop
+ */
+void runClassifyBenchmark(const char *path)
+{
+	ColonyCounter colonyCounter;
+	colonyCounter.loadTrainingQuantized(svmLookup, svmQuants);
+
+	Mat petri = makePetriCrop(colonyCounter, path, 3000);
+	if (petri.empty()) {
+		printf("Could not make petri crop from %s\n", path);
+		return;
+	}
+
+	double megapixels = petri.rows * petri.cols / 1e6;
+	printf("Classifying %dx%d petri crop from %s\n", petri.cols, petri.rows, path);
+
+	Mat reference, classified;
+	double columnTime = 1e9, rowTime = 1e9, tableTime = 1e9;
+	for (int k=0;k<BENCH_REPEATS;k++)
+	{
+		double t0 = (double)getTickCount();
+		reference = classifyColumnMajor(petri);
+		double t1 = (double)getTickCount();
+		classified = colonyCounter.classifyImage(petri);
+		double t2 = (double)getTickCount();
+		columnTime = min(columnTime, (t1 - t0)/getTickFrequency());
+		rowTime = min(rowTime, (t2 - t1)/getTickFrequency());
+	}
+	int rowDiffs = countNonZero(reference != classified);
+
+	colonyCounter.buildColorTable(ColonyCounter::COLOR_TABLE_FULL);
+	for (int k=0;k<BENCH_REPEATS;k++)
+	{
+		double t0 = (double)getTickCount();
+		classified = colonyCounter.classifyImage(petri);
+		tableTime = min(tableTime, ((double)getTickCount() - t0)/getTickFrequency());
+	}
+	int tableDiffs = countNonZero(reference != classified);
+
+	printf("%-22s %8.1f ms %8.1f Mpx/s\n", "column-major loop", columnTime*1000, megapixels/columnTime);
+	printf("%-22s %8.1f ms %8.1f Mpx/s  %5.1fx  %d differences\n", "row kernel", 
+		rowTime*1000, megapixels/rowTime, columnTime/rowTime, rowDiffs);
+	printf("%-22s %8.1f ms %8.1f Mpx/s  %5.1fx  %d differences\n", "full color table", 
+		tableTime*1000, megapixels/tableTime, columnTime/tableTime, tableDiffs);
+}
+
+/*
+ * Normalizes an image the way preprocessImage did before normalizeRow, with
+ * matrix expressions. OpenCV evaluates (petri * 200) / background as a single
+ * divide(petri, background, dst, 200), with no 8-bit intermediate, so it only
+ * differs from the exact result by rounding. Kept as a baseline.
+ */
+static Mat normalizeExpression(Mat petri, Mat background, Mat mask)
+{
+	Mat highpass = (petri * 200) / background;
+	highpass.setTo(Scalar(200, 200, 200), mask == 0);
+	return highpass;
+}
+
+/*
+ * Normalizes an image a pixel at a time, as the tail of normalizeRow does
+ */
+static Mat normalizeScalar(Mat petri, Mat background, Mat mask)
+{
+	Mat highpass(petri.size(), CV_8UC3);
+	for (int y=0;y<petri.rows;y++)
+	{
+		const unsigned char *src = petri.ptr<unsigned char>(y), *bg = background.ptr<unsigned char>(y);
+		const unsigned char *m = mask.ptr<unsigned char>(y);
+		unsigned char *dst = highpass.ptr<unsigned char>(y);
+		for (int k=0;k<petri.cols*3;k++)
+		{
+			int val = bg[k] == 0 ? 0 : (src[k] * 400 + bg[k]) / (bg[k] * 2);
+			dst[k] = !m[k/3] ? 200 : val > 255 ? 255 : val;
+		}
+	}
+	return highpass;
+}
+
+/*
+ * Compares normalization against the background on a 3000x3000 petri crop
+ */
+void runNormalizeBenchmark(const char *path)
+{
+	Mat img = imread(path);
+	Rect petriRect = img.empty() ? Rect() : findPetriRect(img);
+	if (petriRect.height == 0) {
+		printf("Could not make petri crop from %s\n", path);
+		return;
+	}
+	Mat petri;
+	resize(img(petriRect), petri, Size(3000, 3000), 0, 0, INTER_LINEAR);
+
+	// A blurred copy stands in for the estimated background, as only the values matter here
+	Mat background, mask(petri.size(), CV_8U, Scalar(0));
+	blur(petri, background, Size(101, 101));
+	circle(mask, Point(petri.cols/2, petri.rows/2), petri.cols/2, Scalar(255), -1);
+
+	double megapixels = petri.rows * petri.cols / 1e6;
+	printf("Normalizing %dx%d petri crop from %s\n", petri.cols, petri.rows, path);
+
+	Mat reference, expression, kernel(petri.size(), CV_8UC3);
+	double expressionTime = 1e9, scalarTime = 1e9, kernelTime = 1e9;
+	for (int k=0;k<BENCH_REPEATS;k++)
+	{
+		double t0 = (double)getTickCount();
+		expression = normalizeExpression(petri, background, mask);
+		double t1 = (double)getTickCount();
+		reference = normalizeScalar(petri, background, mask);
+		double t2 = (double)getTickCount();
+		for (int y=0;y<petri.rows;y++)
+			normalizeRow(petri.ptr<unsigned char>(y), background.ptr<unsigned char>(y), mask.ptr<unsigned char>(y),
+				kernel.ptr<unsigned char>(y), petri.cols);
+		double t3 = (double)getTickCount();
+		expressionTime = min(expressionTime, (t1 - t0)/getTickFrequency());
+		scalarTime = min(scalarTime, (t2 - t1)/getTickFrequency());
+		kernelTime = min(kernelTime, (t3 - t2)/getTickFrequency());
+	}
+
+	// Channels which differ from the exact result. For the expressions these are
+	// only rounding differences
+	Mat diff;
+	absdiff(expression, reference, diff);
+	int expressionDiffs = countNonZero(diff.reshape(1));
+	absdiff(kernel, reference, diff);
+	int kernelDiffs = countNonZero(diff.reshape(1));
+
+	printf("%-22s %8.1f ms %8.1f Mpx/s          %d rounding differences\n", "matrix expressions", 
+		expressionTime*1000, megapixels/expressionTime, expressionDiffs);
+	printf("%-22s %8.1f ms %8.1f Mpx/s  %5.1fx\n", "scalar loop", 
+		scalarTime*1000, megapixels/scalarTime, expressionTime/scalarTime);
+	printf("%-22s %8.1f ms %8.1f Mpx/s  %5.1fx  %d differences\n", "row kernel", 
+		kernelTime*1000, megapixels/kernelTime, expressionTime/kernelTime, kernelDiffs);
+}
+
+/*
+ * Times the per-pixel stages of one plate with increasing numbers of threads
+ */
+void runThreadScalingBenchmark(const char *path)
+{
+	ColonyCounter colonyCounter;
+	colonyCounter.loadTrainingQuantized(svmLookup, svmQuants);
+
+	Mat img = imread(path);
+	Rect petriRect = img.empty() ? Rect() : findPetriRect(img);
+	if (petriRect.height == 0) {
+		printf("Could not make petri crop from %s\n", path);
+		return;
+	}
+	Mat petri;
+	resize(img(petriRect), petri, Size(3000, 3000), 0, 0, INTER_LINEAR);
+
+	printf("Processing %dx%d petri crop from %s\n", petri.cols, petri.rows, path);
+	printf("%7s %10s %10s %10s %10s %8s %10s\n", "threads", "preprocess", "classify", "count", "total", "speedup", "efficiency");
+
+	// Powers of two up to the number of cores, then all cores
+	int maxThreads = defaultThreadCount();
+	vector<int> threadCounts;
+	for (int threads=1;threads<maxThreads;threads*=2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(maxThreads);
+
+	double serialTime = 0;
+	Mat serialHighpass, serialClassified;
+	int serialRed = 0, serialBlue = 0;
+	for (int i=0;i<threadCounts.size();i++)
+	{
+		int threads = threadCounts[i];
+		colonyCounter.setNumThreads(threads);
+
+		double preTime = 1e9, classTime = 1e9, countTime = 1e9, totalTime = 1e9;
+		Mat highpass, classified;
+		int red, blue;
+		for (int k=0;k<BENCH_REPEATS;k++)
+		{
+			double t0 = (double)getTickCount();
+			highpass = colonyCounter.preprocessImage(petri);
+			double t1 = (double)getTickCount();
+			classified = colonyCounter.classifyImage(highpass);
+			double t2 = (double)getTickCount();
+			colonyCounter.countColonies(classified, red, blue);
+			double t3 = (double)getTickCount();
+
+			preTime = min(preTime, (t1 - t0)/getTickFrequency());
+			classTime = min(classTime, (t2 - t1)/getTickFrequency());
+			countTime = min(countTime, (t3 - t2)/getTickFrequency());
+			totalTime = min(totalTime, (t3 - t0)/getTickFrequency());
+		}
+
+		if (threads == 1)
+		{
+			serialTime = totalTime;
+			serialHighpass = highpass;
+			serialClassified = classified;
+			serialRed = red;
+			serialBlue = blue;
+		}
+
+		bool same = norm(highpass, serialHighpass, NORM_INF) == 0 
+			&& countNonZero(classified != serialClassified) == 0
+			&& red == serialRed && blue == serialBlue;
+
+		double speedup = serialTime / totalTime;
+		printf("%7d %8.1fms %8.1fms %8.1fms %8.1fms %7.2fx %9.0f%%%s\n", threads, 
+			preTime*1000, classTime*1000, countTime*1000, totalTime*1000, 
+			speedup, speedup / threads * 100, same ? "" : "  RESULTS DIFFER");
+	}
+}
+
+/*
+ * Cleans up the mask of one type of colony with OpenCV morphology on a byte
+ * per pixel, as countColonies did before bit planes. Kept as a baseline to
+ * measure against.
+ */
+static Mat cleanTypeMask(Mat classified, int type)
+{
+	Mat mask = classified == type;
+
+	Mat kernel = getStructuringElement(MORPH_CROSS, Size(3, 3));
+	erode(mask, mask, kernel);
+	dilate(mask, mask, kernel);
+	erode(mask, mask, kernel);
+
+	kernel = getStructuringElement(MORPH_ELLIPSE, Size(5, 5));
+	dilate(mask, mask, kernel);
+	erode(mask, mask, kernel);
+	dilate(mask, mask, kernel);
+	erode(mask, mask, kernel);
+	return mask;
+}
+
+/*
+ * Counts the colonies of a cleaned up mask with findContours, contourArea and
+ * arcLength, as countColonies did before labelComponents. Kept as a baseline.
+ */
+static int countContourColonies(Mat mask)
+{
+	vector<vector<Point> > contours;
+	findContours(mask, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE);
+
+	int count = 0;
+	for (int i=0;i<contours.size();i++)
+	{
+		double area = contourArea(contours[i]);
+		double perimeter = arcLength(contours[i], true);
+		if (area >= 4 && 4 * 3.14159265 * area / (perimeter * perimeter) > 0.2)
+			count++;
+	}
+	return count;
+}
+
+/*
+ * Counts the colonies of a cleaned up plane as countColonies does
+ */
+static int countLabeledColonies(const BitPlane& plane)
+{
+	vector<Component> components;
+	labelComponents(plane, components);
+
+	int count = 0;
+	for (int i=0;i<components.size();i++)
+	{
+		const Component& comp = components[i];
+		if (!comp.nested && comp.area >= 4 && 4 * 3.14159265 * comp.area / (comp.perimeter * comp.perimeter) > 0.2)
+			count++;
+	}
+	return count;
+}
+
+/*
+ * Compares cleaning up the colony masks of a 3000x3000 petri crop with byte
+ * masks and with bit planes, and finding colonies in them with contours and
+ * with labelComponents, and times counting colonies
+ */
+void runCountBenchmark(const char *path)
+{
+	ColonyCounter colonyCounter;
+	colonyCounter.loadTrainingQuantized(svmLookup, svmQuants);
+
+	Mat petri = makePetriCrop(colonyCounter, path, 3000);
+	if (petri.empty()) {
+		printf("Could not make petri crop from %s\n", path);
+		return;
+	}
+	Mat classified = colonyCounter.classifyImage(petri);
+	printf("Counting %dx%d petri crop from %s\n", classified.cols, classified.rows, path);
+
+	static const BitMorphOp ops[] = {
+		{ BIT_MORPH_CROSS3, false }, { BIT_MORPH_CROSS3, true }, { BIT_MORPH_CROSS3, false },
+		{ BIT_MORPH_ELLIPSE5, true }, { BIT_MORPH_ELLIPSE5, false }, { BIT_MORPH_ELLIPSE5, true }, { BIT_MORPH_ELLIPSE5, false }
+	};
+	int types[] = { 1, 2 };
+
+	Mat masks[2];
+	BitPlane planes[2];
+	double byteTime = 1e9, bitTime = 1e9, contourTime = 1e9, labelTime = 1e9, countTime = 1e9;
+	int red, blue, contourCounts[2], labelCounts[2];
+	for (int k=0;k<BENCH_REPEATS;k++)
+	{
+		double t0 = (double)getTickCount();
+		for (int i=0;i<2;i++)
+			masks[i] = cleanTypeMask(classified, types[i]);
+		double t1 = (double)getTickCount();
+		packClasses(classified, types, planes, 2, 1);
+		morphBitPlanes(planes, 2, ops, 7, 1);
+		double t2 = (double)getTickCount();
+		for (int i=0;i<2;i++)
+			contourCounts[i] = countContourColonies(masks[i].clone());
+		double t3 = (double)getTickCount();
+		for (int i=0;i<2;i++)
+			labelCounts[i] = countLabeledColonies(planes[i]);
+		double t4 = (double)getTickCount();
+		colonyCounter.countColonies(classified, red, blue);
+		double t5 = (double)getTickCount();
+
+		byteTime = min(byteTime, (t1 - t0)/getTickFrequency());
+		bitTime = min(bitTime, (t2 - t1)/getTickFrequency());
+		contourTime = min(contourTime, (t3 - t2)/getTickFrequency());
+		labelTime = min(labelTime, (t4 - t3)/getTickFrequency());
+		countTime = min(countTime, (t5 - t4)/getTickFrequency());
+	}
+
+	int diffs = 0;
+	for (int i=0;i<2;i++)
+	{
+		Mat mask;
+		planes[i].toMask(mask);
+		diffs += countNonZero(mask != masks[i]);
+	}
+
+	printf("%-22s %8.1f ms\n", "byte masks", byteTime*1000);
+	printf("%-22s %8.1f ms  %5.1fx  %d differences\n", "bit planes", bitTime*1000, byteTime/bitTime, diffs);
+	printf("%-22s %8.1f ms  (%d red, %d blue)\n", "contours", contourTime*1000, contourCounts[0], contourCounts[1]);
+	printf("%-22s %8.1f ms  %5.1fx  (%d red, %d blue)%s\n", "labelComponents", labelTime*1000, contourTime/labelTime, 
+		labelCounts[0], labelCounts[1], 
+		labelCounts[0] == contourCounts[0] && labelCounts[1] == contourCounts[1] ? "" : "  COUNTS DIFFER");
+	printf("%-22s %8.1f ms  (%d red, %d blue)\n", "countColonies", countTime*1000, red, blue);
+}
+
+/*
+ * Adds edges which are not part of the dish to an image, as textured backgrounds
+ * and labels would: short random strokes and text
+ */
+static Mat addClutter(Mat img)
+{
+	Mat cluttered = img.clone();
+	RNG rng(12345);
+	int size = max(img.rows, img.cols);
+	for (int i=0;i<4000;i++)
+	{
+		Point p(rng.uniform(0, img.cols), rng.uniform(0, img.rows));
+		Point d(rng.uniform(-size/100, size/100), rng.uniform(-size/100, size/100));
+		line(cluttered, p, p + d, Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)), 
+			max(size/500, 1));
+	}
+	for (int i=0;i<40;i++)
+	{
+		Point p(rng.uniform(0, img.cols), rng.uniform(0, img.rows));
+		putText(cluttered, "E.coli 2014-03-17 #42", p, FONT_HERSHEY_SIMPLEX, size/1000.0, 
+			Scalar(0, 0, 0), max(size/500, 1));
+	}
+	return cluttered;
+}
+
+/*
+ * Finds the edges of an image scaled to PETRI_SEARCH_SIZE, as findDishCircle does
+ */
+static Mat findSearchEdges(Mat img)
+{
+	Mat gray, resized, edges;
+	cvtColor(img, gray, CV_BGR2GRAY);
+	double scaleby = max(gray.rows, gray.cols)*1.0/PETRI_SEARCH_SIZE;
+	resize(gray, resized, Size(), 1.0/scaleby, 1.0/scaleby, INTER_CUBIC);
+	GaussianBlur(resized, resized, Size(9,9), 1, 1);
+	Canny(resized, edges, 30, 15);
+	return edges;
+}
+
+/*
+ * Handles the contours of an edge image as findDishCircle did before ContourSet,
+ * with a vector for each contour, for two rounds of the search around a circle.
+ * Kept as a baseline. Returns the number of points left.
+ */
+static int handleContourVectors(Mat edges, Point center, double radius)
+{
+	vector<vector<Point> > contours;
+	vector<Vec4i> hierarchy;
+	findContours(edges.clone(), contours, hierarchy, CV_RETR_LIST, CV_CHAIN_APPROX_NONE);
+
+	for (int round=0;round<2;round++)
+	{
+		// Remove small contours and contours with few points
+		vector<vector<Point> > contours2;
+		for (int c=0;c<contours.size();c++) {
+			Rect r = boundingRect(contours[c]);
+			if ((r.width > 120 || r.height > 120) && contours[c].size() >= 15)
+				contours2.push_back(contours[c]);
+		}
+		contours = contours2;
+
+		// Put points of all contours in one array, as findBestCenter did
+		vector<Point> points;
+		vector<int> starts;
+		for (int c=0;c<contours.size();c++)
+		{
+			starts.push_back(points.size());
+			points.insert(points.end(), contours[c].begin(), contours[c].end());
+		}
+		starts.push_back(points.size());
+
+		// Remove any contour points not well inside circle
+		contours2.clear();
+		for (int c=0;c<contours.size();c++)
+		{
+			vector<Point> ctr;
+			for (int i=0;i<contours[c].size();i++)
+			{
+				if (norm(contours[c][i]-center) <= radius - round * 4)
+					ctr.push_back(contours[c][i]);
+			}
+			if (ctr.size() > 0)
+				contours2.push_back(ctr);
+		}
+		contours = contours2;
+	}
+
+	int total = 0;
+	for (int c=0;c<contours.size();c++)
+		total += contours[c].size();
+	return total;
+}
+
+/*
+ * Handles the contours of an edge image as findDishCircle does, for two rounds
+ * of the search around a circle. Returns the number of points left.
+ */
+static int handleContourSet(Mat edges, Point center, double radius)
+{
+	ContourSet contours;
+	findContourSet(edges, contours);
+
+	for (int round=0;round<2;round++)
+	{
+		removeSmallContours(contours, 120, 15);
+		removeOutsidePoints(contours, center, radius - round * 4);
+	}
+	return contours.points.size();
+}
+
+/*
+ * Times finding the dish in an image as is and with clutter added, and times
+ * handling its contours with a vector per contour and with a ContourSet
+ */
+void runCircleBenchmark(const char *path)
+{
+	Mat img = imread(path);
+	if (img.empty()) {
+		printf("Could not load %s\n", path);
+		return;
+	}
+
+	const char *names[] = { "plain", "cluttered" };
+	Mat images[] = { img, addClutter(img) };
+
+	printf("Finding dish in %dx%d image %s\n", img.cols, img.rows, path);
+	if (heapAllocations() < 0)
+		printf("Heap allocations are only counted by ec-plates-bench (make bench)\n");
+	printf("%-10s %-16s %10s %12s %s\n", "image", "stage", "time", "allocations", "result");
+	for (int i=0;i<2;i++)
+	{
+		double bestTime = 1e9;
+		string allocs;
+		Vec3f circ;
+		for (int k=0;k<BENCH_REPEATS;k++)
+		{
+			long a0 = heapAllocations();
+			double t0 = (double)getTickCount();
+			circ = findPetriDish(images[i]);
+			bestTime = min(bestTime, ((double)getTickCount() - t0)/getTickFrequency());
+			allocs = allocationsSince(a0);
+		}
+		printf("%-10s %-16s %8.1fms %12s (%.0f, %.0f) r=%.0f\n", names[i], "findPetriDish", bestTime*1000, 
+			allocs.c_str(), circ[0], circ[1], circ[2]);
+
+		// Contour handling only, around the circle found, at the search size
+		Mat edges = findSearchEdges(images[i]);
+		double scaleby = max(img.rows, img.cols)*1.0/PETRI_SEARCH_SIZE;
+		Point center(circ[0] / scaleby, circ[1] / scaleby);
+		double radius = circ[2] / scaleby;
+
+		double vectorTime = 1e9, setTime = 1e9;
+		string vectorAllocs, setAllocs;
+		int vectorPoints, setPoints;
+		for (int k=0;k<BENCH_REPEATS;k++)
+		{
+			long a0 = heapAllocations();
+			double t0 = (double)getTickCount();
+			vectorPoints = handleContourVectors(edges, center, radius);
+			double t1 = (double)getTickCount();
+			vectorAllocs = allocationsSince(a0);
+
+			a0 = heapAllocations();
+			double t2 = (double)getTickCount();
+			setPoints = handleContourSet(edges, center, radius);
+			double t3 = (double)getTickCount();
+			setAllocs = allocationsSince(a0);
+
+			vectorTime = min(vectorTime, (t1 - t0)/getTickFrequency());
+			setTime = min(setTime, (t3 - t2)/getTickFrequency());
+		}
+		printf("%-10s %-16s %8.1fms %12s %d points\n", "", "contour vectors", vectorTime*1000, 
+			vectorAllocs.c_str(), vectorPoints);
+		printf("%-10s %-16s %8.1fms %12s %d points  %.1fx%s\n", "", "ContourSet", setTime*1000, 
+			setAllocs.c_str(), setPoints, vectorTime/setTime, vectorPoints == setPoints ? "" : "  POINTS DIFFER");
+	}
+}
+
+/*
+ * Peak resident set size of the process in KB (VmHWM), or 0 if unknown
+ */
+static long readPeakRSS()
+{
+	FILE *file = fopen("/proc/self/status", "r");
+	if (!file)
+		return 0;
+
+	long peak = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), file))
+		if (sscanf(line, "VmHWM: %ld kB", &peak) == 1)
+			break;
+	fclose(file);
+	return peak;
+}
+
+/*
+ * Resets the peak resident set size to the current one, so that the peak of a
+ * single stage can be measured. Returns false if the kernel does not support it,
+ * in which case the peak is that of the whole process so far.
+ */
+static bool resetPeakRSS()
+{
+	FILE *file = fopen("/proc/self/clear_refs", "w");
+	if (!file)
+		return false;
+	bool ok = fputs("5", file) >= 0;
+	return fclose(file) == 0 && ok;
+}
+
+/*
+ * Timings of one stage over all runs
+ */
+struct StageTimes
+{
+	const char *name;
+	vector<double> seconds;		// Time of each run
+	double pixels;				// Pixels processed over all runs
+	long peakRSS;				// Highest peak RSS seen during the stage, in KB
+
+	StageTimes(const char *name) : name(name), pixels(0), peakRSS(0) {
+	}
+
+	// Time at a fraction (0 to 1) of the sorted runs, by nearest rank
+	double percentile(double fraction) const {
+		vector<double> sorted = seconds;
+		sort(sorted.begin(), sorted.end());
+		int rank = (int)ceil(fraction * sorted.size());
+		return sorted[max(min(rank, (int)sorted.size()) - 1, 0)];
+	}
+
+	double total() const {
+		double sum = 0;
+		for (int i=0;i<seconds.size();i++)
+			sum += seconds[i];
+		return sum;
+	}
+};
+
+/*
+ * Starts timing a stage, returning the start time
+ */
+static double beginStage()
+{
+	resetPeakRSS();
+	return (double)getTickCount();
+}
+
+/*
+ * Records a run of a stage started with beginStage
+ */
+static void endStage(StageTimes& stage, double t0, double pixels)
+{
+	stage.seconds.push_back(((double)getTickCount() - t0)/getTickFrequency());
+	stage.pixels += pixels;
+	stage.peakRSS = max(stage.peakRSS, readPeakRSS());
+}
+
+/*
+ * Runs each stage once on an image, adding to the times of the stages
+ */
+static void runStagesOnce(ColonyCounter& colonyCounter, ColonyCounter& svmCounter, Mat img, StageTimes *stages)
+{
+	double t0 = beginStage();
+	Vec3f circ = findPetriDish(img);
+	endStage(stages[0], t0, img.rows * img.cols);
+
+	// Images whose dish is not found, or not within the image, fail as with the count command
+	Rect petriRect = petriRectFromCircle(circ);
+	if (petriRect.height == 0 || (petriRect & Rect(0, 0, img.cols, img.rows)) != petriRect)
+		return;
+	Mat petri = img(petriRect);
+	double pixels = petri.rows * petri.cols;
+
+	t0 = beginStage();
+	Mat highpass = colonyCounter.preprocessImage(petri);
+	endStage(stages[1], t0, pixels);
+
+	t0 = beginStage();
+	Mat classified = colonyCounter.classifyImage(highpass);
+	endStage(stages[2], t0, pixels);
+
+	t0 = beginStage();
+	svmCounter.classifyImageQuant(highpass, false, NULL, svmQuants);
+	endStage(stages[3], t0, pixels);
+
+	int red, blue;
+	t0 = beginStage();
+	colonyCounter.countColonies(classified, red, blue);
+	endStage(stages[4], t0, pixels);
+}
+
+/*
+ * Times each stage of the algorithm over the images of samples/tests.yml, each
+ * repeated the given number of times, and writes the results as JSON
+ */
+void runStageBenchmark(int repeats, const char *jsonPath)
+{
+	// Counter as used by the count command, and one using the SVM itself for
+	// classifyImageQuant as the quant command does
+	ColonyCounter colonyCounter;
+	if (!loadECPlateTraining(colonyCounter)) {
+		printf("Could not load model\n");
+		return;
+	}
+	ColonyCounter svmCounter;
+	svmCounter.loadTraining("svm_params.yml");
+
+	StageTimes stages[] = { StageTimes("findPetriDish"), StageTimes("preprocessImage"), StageTimes("classifyImage"), 
+		StageTimes("classifyImageQuant"), StageTimes("countColonies") };
+	const int numStages = 5;
+
+	bool perStageRSS = resetPeakRSS();
+
+	FileStorage fs("samples/tests.yml", FileStorage::READ);
+	FileNode tests = fs["tests"];
+	int numImages = 0;
+	for (FileNodeIterator it = tests.begin(); it != tests.end(); ++it)
+	{
+		string path;
+		(*it)["path"] >> path;
+		Mat img = imread("samples/" + path);
+		if (img.empty()) {
+			printf("Could not load samples/%s\n", path.c_str());
+			continue;
+		}
+		numImages++;
+		printf("Benchmarking %s\n", path.c_str());
+
+		// Run once first so that caches and allocations are warm
+		StageTimes warmup[] = { StageTimes(""), StageTimes(""), StageTimes(""), StageTimes(""), StageTimes("") };
+		runStagesOnce(colonyCounter, svmCounter, img, warmup);
+
+		for (int k=0;k<repeats;k++)
+			runStagesOnce(colonyCounter, svmCounter, img, stages);
+	}
+	fs.release();
+
+	printf("%d images, %d runs each%s\n", numImages, repeats, 
+		perStageRSS ? "" : " (peak RSS is for the whole process)");
+	printf("%-20s %6s %10s %10s %10s %10s %10s\n", "stage", "runs", "min", "median", "p99", "Mpx/s", "peak RSS");
+	for (int i=0;i<numStages;i++)
+	{
+		const StageTimes& s = stages[i];
+		if (s.seconds.empty())
+			continue;
+		printf("%-20s %6d %8.2fms %8.2fms %8.2fms %10.1f %8ldMB\n", s.name, (int)s.seconds.size(), 
+			s.percentile(0)*1000, s.percentile(0.5)*1000, s.percentile(0.99)*1000, 
+			s.pixels / s.total() / 1e6, s.peakRSS / 1024);
+	}
+
+	// Machine readable results, to compare between builds
+	FILE *file = fopen(jsonPath, "w");
+	if (!file) {
+		printf("Could not write %s\n", jsonPath);
+		return;
+	}
+	fprintf(file, "{\n  \"images\": %d,\n  \"repeats\": %d,\n  \"per_stage_rss\": %s,\n  \"stages\": {", 
+		numImages, repeats, perStageRSS ? "true" : "false");
+	bool first = true;
+	for (int i=0;i<numStages;i++)
+	{
+		const StageTimes& s = stages[i];
+		if (s.seconds.empty())
+			continue;
+		fprintf(file, "%s\n    \"%s\": {\"runs\": %d, \"min_ms\": %.3f, \"median_ms\": %.3f, \"p99_ms\": %.3f, "
+			"\"pixels_per_sec\": %.0f, \"peak_rss_kb\": %ld}", first ? "" : ",", s.name, (int)s.seconds.size(),
+			s.percentile(0)*1000, s.percentile(0.5)*1000, s.percentile(0.99)*1000, s.pixels / s.total(), s.peakRSS);
+		first = false;
+	}
+	fprintf(file, "\n  }\n}\n");
+	if (fclose(file) != 0)
+		printf("Could not write %s\n", jsonPath);
+	else
+		printf("Wrote %s\n", jsonPath);
+}
+
+/*
+ * Loads the images of samples/tests.yml and finds their dishes
+ */
+static vector<Mat> loadTestPetris()
+{
+	vector<Mat> petris;
+	FileStorage fs("samples/tests.yml", FileStorage::READ);
+	FileNode tests = fs["tests"];
+	for (FileNodeIterator it = tests.begin(); it != tests.end(); ++it)
+	{
+		string path;
+		(*it)["path"] >> path;
+		Mat img = imread("samples/" + path);
+		if (img.empty()) {
+			printf("Could not load samples/%s\n", path.c_str());
+			continue;
+		}
+
+		Rect petriRect = findPetriRect(img);
+		if (petriRect.height > 0 && (petriRect & Rect(0, 0, img.cols, img.rows)) == petriRect)
+			petris.push_back(img(petriRect));
+	}
+	return petris;
+}
+
+/*
+ * Classifies and counts the dishes of the test images several times over, as a
+ * count-batch worker does, with and without a workspace, reporting the time and
+ * heap allocations of each pass over the images
+ */
+void runWorkspaceBenchmark(int passes)
+{
+	ColonyCounter colonyCounter;
+	if (!loadECPlateTraining(colonyCounter)) {
+		printf("Could not load model\n");
+		return;
+	}
+
+	vector<Mat> petris = loadTestPetris();
+	if (petris.empty()) {
+		printf("No test images\n");
+		return;
+	}
+	printf("Classifying and counting %d dishes, %d passes\n", (int)petris.size(), passes);
+	if (heapAllocations() < 0)
+		printf("Heap allocations are only counted by ec-plates-bench (make bench)\n");
+	printf("%-10s %5s %10s %12s %s\n", "mode", "pass", "time", "allocations", "colonies");
+
+	vector<int> expected(petris.size());
+	ColonyWorkspace workspace;
+	for (int mode=0;mode<2;mode++)
+	{
+		bool reuse = mode == 1;
+		for (int pass=0;pass<passes;pass++)
+		{
+			long a0 = heapAllocations();
+			double t0 = (double)getTickCount();
+			int total = 0;
+			bool same = true;
+			for (int i=0;i<petris.size();i++)
+			{
+				int found;
+				if (reuse) {
+					Mat classified = ColonyWorkspace::reuse(workspace.classifiedStorage, petris[i].size(), CV_8U);
+					colonyCounter.classifyPetri(petris[i], classified, workspace);
+					colonyCounter.countColonies(classified, workspace.colonies, workspace);
+					found = workspace.colonies.size();
+				}
+				else {
+					int red, blue;
+					colonyCounter.countColonies(colonyCounter.classifyPetri(petris[i]), red, blue);
+					found = red + blue;
+					expected[i] = found;
+				}
+				same = same && found == expected[i];
+				total += found;
+			}
+			double seconds = ((double)getTickCount() - t0)/getTickFrequency();
+			printf("%-10s %5d %8.1fms %12s %d%s\n", reuse ? "workspace" : "none", pass + 1, seconds*1000, 
+				allocationsSince(a0).c_str(), total, same ? "" : "  RESULTS DIFFER");
+		}
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ * Benchmarks of the individual stages of the algorithm. See benchmark.cpp
+ */
+
+// Times classification of a 3000x3000 petri crop made from the given image
+void runClassifyBenchmark(const char *path);
+
+// Times normalizing a 3000x3000 petri crop against its background with matrix
+// expressions, a scalar loop and normalizeRow, checking normalizeRow is exact
+void runNormalizeBenchmark(const char *path);
+
+// Times preprocessing, classification and counting of a 3000x3000 petri crop
+// with 1 to N threads, checking that results do not change
+void runThreadScalingBenchmark(const char *path);
+
+// Times cleaning up the colony masks of a 3000x3000 petri crop with byte masks and
+// with bit planes, and finding colonies with contours and with labelComponents,
+// checking that they agree, and times counting colonies
+void runCountBenchmark(const char *path);
+
+// Times finding the dish in the given image, plain and with edge clutter added,
+// and handling its contours with a vector per contour and with a ContourSet,
+// counting heap allocations in the benchmark build
+void runCircleBenchmark(const char *path);
+
+// Times findPetriDish, preprocessImage, classifyImage, classifyImageQuant and 
+// countColonies over the images of samples/tests.yml, reporting min, median and
+// p99 time, pixels per second and peak RSS of each, and writes them as JSON
+void runStageBenchmark(int repeats, const char *jsonPath);
+
+// Classifies and counts the dishes of the images of samples/tests.yml for a
+// number of passes, with a new workspace for each image and with one reused
+// workspace, reporting time and heap allocations of each pass
+void runWorkspaceBenchmark(int passes);
@@ -5,9 +5,18 @@
 #include "CircleFinder.h"
 #include "ColonyCounter.h"
 #include "OpenCVActivityContext.h"
+#include "Parallel.h"
 #include "algorithm.h"
+#include "benchmark.h"
+#include "pipeline.h"
+#include "server.h"
 #include "svm_table.h"
 
+#include <algorithm>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
 using namespace cv;
 
 /*
@@ -39,22 +48,41 @@ void timeit(const char *name) {
 void runTestCircles()
 {
 	bool debug = false;
+	CircleFinderParams coarseParams;
+	coarseParams.coarseToFine = true;
+
+	double totalTime = 0, totalCoarseTime = 0, maxShift = 0;
 	for (int k=1;k<=4;k++) 
 	{
 		// Load image
 		image = imread(format("samples/images/%03d.jpg", k));
 		Mat refImage = imread(format("samples/train/%03d_circle.png", k));
 
+		double t0 = (double)getTickCount();
 		Vec3f circ = findPetriDish(image);
+		totalTime += ((double)getTickCount() - t0)/getTickFrequency();
 		testCirclePerformance(circ, refImage);
 
+		// Coarse-to-fine detection should find the same circle
+		t0 = (double)getTickCount();
+		Vec3f coarseCirc = findPetriDish(image, coarseParams);
+		totalCoarseTime += ((double)getTickCount() - t0)/getTickFrequency();
+		double shift = max(norm(Point2f(circ[0], circ[1]) - Point2f(coarseCirc[0], coarseCirc[1])),
+			(double)fabs(circ[2] - coarseCirc[2]));
+		maxShift = max(maxShift, shift);
+		printf("coarse-to-fine: ");
+		testCirclePerformance(coarseCirc, refImage);
+
 		if (debug) {
 			circle(refImage, Point(circ[0], circ[1]), circ[2], Scalar(255,0,0), 2);
+			circle(refImage, Point(coarseCirc[0], coarseCirc[1]), coarseCirc[2], Scalar(0,255,255), 2);
 			namedWindow(format("%03d", k), CV_GUI_EXPANDED);
 			imshow(format("%03d", k), refImage);
 			waitKey(0);
 		}
 	}
+	printf("time %.1f ms, coarse-to-fine %.1f ms, max difference %.1f px\n", 
+		totalTime * 1000, totalCoarseTime * 1000, maxShift);
 }
 
 /*
@@ -70,10 +98,16 @@ void runTest(ColonyCounter& colonyCounter, string path, int redExpected, int blu
 	Mat petri = img(petriRect);
 
 	// Preprocess image
-	petri = colonyCounter.preprocessImage(petri);
+	Mat preprocessed = colonyCounter.preprocessImage(petri);
 
 	// Classify image
-	Mat classified = colonyCounter.classifyImage(petri);
+	Mat classified = colonyCounter.classifyImage(preprocessed);
+
+	// Fused path should classify every pixel the same as the two steps
+	Mat fused = colonyCounter.classifyPetri(petri);
+	int mismatched = countNonZero(fused != classified);
+	if (mismatched > 0)
+		printf("classifyPetri differs on %d pixels: %s\n", mismatched, path.c_str());
 
 	// Count colonies
 	int red, blue;
@@ -187,6 +221,174 @@ void runTestsSVMTable()
 	printf("Error %f\n", absErrorSum);
 }
 
+/*
+ * Like runTestsSVMTable, but with the BGR color table built from the quantized
+ * lookup table, as the server uses
+ */
+void runTestsColorTable()
+{
+	ColonyCounter colonyCounter;
+	colonyCounter.loadTrainingQuantized(svmLookup, svmQuants);
+	colonyCounter.buildColorTable(ColonyCounter::COLOR_TABLE_FULL);
+
+	FileStorage fs("samples/tests.yml", FileStorage::READ);
+
+	double absErrorSum = 0;
+
+	FileNode features = fs["tests"];
+	FileNodeIterator it = features.begin(), it_end = features.end();
+	int idx = 0;
+	for( ; it != it_end; ++it, idx++ )
+	{
+		string path;
+		(*it)["path"] >> path;
+		int red = (int)(*it)["red"];
+		int blue = (int)(*it)["blue"];
+
+		double error;
+		runTest(colonyCounter, "samples/" + path, red, blue, error);
+		absErrorSum += fabs(error);
+
+	}
+	fs.release();
+
+	printf("Error %f\n", absErrorSum);
+}
+
+/*
+ * Compares classifying with the hyperplanes of the linear SVM against calling
+ * the SVM itself and against the quantized lookup (classifyImageQuant)
+ */
+void runLinearTests()
+{
+	ColonyCounter colonyCounter;
+	colonyCounter.loadTraining("svm_params.yml");
+
+	FileStorage fs("samples/tests.yml", FileStorage::READ);
+
+	double linearTime = 0, svmTime = 0, quantTime = 0;
+	long linearDiffs = 0, quantDiffs = 0, pixels = 0;
+
+	FileNode features = fs["tests"];
+	FileNodeIterator it = features.begin(), it_end = features.end();
+	for( ; it != it_end; ++it )
+	{
+		string path;
+		(*it)["path"] >> path;
+
+		Mat img = imread("samples/" + path);
+		Rect petriRect = findPetriRect(img);
+		Mat petri = colonyCounter.preprocessImage(img(petriRect));
+
+		colonyCounter.setLinearClassifier(true);
+		double t0 = (double)getTickCount();
+		Mat linear = colonyCounter.classifyImage(petri);
+		linearTime += ((double)getTickCount() - t0)/getTickFrequency();
+
+		t0 = (double)getTickCount();
+		Mat quant = colonyCounter.classifyImageQuant(petri, false, NULL, quants);
+		quantTime += ((double)getTickCount() - t0)/getTickFrequency();
+
+		colonyCounter.setLinearClassifier(false);
+		t0 = (double)getTickCount();
+		Mat reference = colonyCounter.classifyImage(petri);
+		svmTime += ((double)getTickCount() - t0)/getTickFrequency();
+
+		int diffs = countNonZero(linear != reference);
+		int qdiffs = countNonZero(quant != reference);
+		printf("%s: linear %d differences, quantized %d differences of %d pixels\n", 
+			path.c_str(), diffs, qdiffs, petri.rows * petri.cols);
+		linearDiffs += diffs;
+		quantDiffs += qdiffs;
+		pixels += petri.rows * petri.cols;
+	}
+	fs.release();
+
+	printf("svm      %8.1f ms\n", svmTime * 1000);
+	printf("linear   %8.1f ms  %ld differences\n", linearTime * 1000, linearDiffs);
+	printf("quantized%8.1f ms  %ld differences\n", quantTime * 1000, quantDiffs);
+	printf("of %ld pixels\n", pixels);
+}
+
+/*
+ * Checks the accuracy of estimating the background at reduced scales
+ * against the full resolution background over all test images
+ */
+void runBackgroundTests()
+{
+	static const int scales[] = { 4, 8 };
+	static const int numScales = 2;
+
+	ColonyCounter colonyCounter;
+	colonyCounter.loadTrainingQuantized(svmLookup, svmQuants);
+
+	FileStorage fs("samples/tests.yml", FileStorage::READ);
+
+	double totalTime = 0, totalScaledTime[numScales] = { 0, 0 };
+	double totalDiff[numScales] = { 0, 0 }, totalWrong[numScales] = { 0, 0 };
+	int countDiffs[numScales] = { 0, 0 };
+	int images = 0;
+
+	FileNode features = fs["tests"];
+	FileNodeIterator it = features.begin(), it_end = features.end();
+	for( ; it != it_end; ++it )
+	{
+		string path;
+		(*it)["path"] >> path;
+
+		Mat img = imread("samples/" + path);
+		Rect petriRect = findPetriRect(img);
+		Mat petri = img(petriRect);
+
+		// Full resolution reference
+		colonyCounter.setBackgroundScale(1);
+		double t0 = (double)getTickCount();
+		Mat highpass = colonyCounter.preprocessImage(petri);
+		totalTime += ((double)getTickCount() - t0)/getTickFrequency();
+		Mat classified = colonyCounter.classifyImage(highpass);
+		int red, blue;
+		colonyCounter.countColonies(classified, red, blue);
+
+		printf("%s: red=%d blue=%d\n", path.c_str(), red, blue);
+
+		for (int i=0;i<numScales;i++)
+		{
+			colonyCounter.setBackgroundScale(scales[i]);
+			t0 = (double)getTickCount();
+			Mat highpassScaled = colonyCounter.preprocessImage(petri);
+			totalScaledTime[i] += ((double)getTickCount() - t0)/getTickFrequency();
+			Mat classifiedScaled = colonyCounter.classifyImage(highpassScaled);
+			int redScaled, blueScaled;
+			colonyCounter.countColonies(classifiedScaled, redScaled, blueScaled);
+
+			// Mean absolute difference per channel and fraction of pixels classified differently
+			double diff = norm(highpass, highpassScaled, NORM_L1) / (highpass.total() * 3);
+			double wrong = countNonZero(classified != classifiedScaled) * 100.0 / classified.total();
+			totalDiff[i] += diff;
+			totalWrong[i] += wrong;
+			if (redScaled != red || blueScaled != blue)
+				countDiffs[i]++;
+
+			printf("  scale 1/%d: mean diff=%5.2f  classified diff=%6.3f%%  red=%d blue=%d%s\n", 
+				scales[i], diff, wrong, redScaled, blueScaled,
+				redScaled != red || blueScaled != blue ? " *" : "");
+		}
+		images++;
+	}
+	fs.release();
+
+	if (images == 0)
+		return;
+
+	printf("full resolution: preprocess %6.1f ms/image\n", totalTime * 1000 / images);
+	for (int i=0;i<numScales;i++)
+	{
+		printf("scale 1/%d: preprocess %6.1f ms/image  mean diff=%5.2f  classified diff=%6.3f%%  count changed on %d of %d\n",
+			scales[i], totalScaledTime[i] * 1000 / images, totalDiff[i] / images, totalWrong[i] / images,
+			countDiffs[i], images);
+	}
+}
+
 /*
  * Run tests to make sure that quantization is working.
  */
@@ -227,18 +429,221 @@ void runQuantTests()
 	fs.release();
 }
 
+/*
+ * Parses a lookup table quantization, either one value for both inputs
+ * ("1024") or one per input ("1024x512")
+ */
+static bool parseQuants(const char *text, int *quants)
+{
+	char *end;
+	quants[0] = strtol(text, &end, 10);
+	quants[1] = quants[0];
+	if (*end == 'x')
+		quants[1] = strtol(end + 1, &end, 10);
+	return *end == 0 && quants[0] >= 2 && quants[0] <= 65536 && quants[1] >= 2 && quants[1] <= 65536;
+}
+
+/*
+ * Gets the images to count from a directory (all images in it, sorted by name)
+ * or from a manifest file (one image path per line). Returns false if the
+ * source cannot be read.
+ */
+static bool readBatchPaths(const char *source, vector<string>& paths)
+{
+	struct stat st;
+	if (stat(source, &st) != 0)
+		return false;
+
+	if (S_ISDIR(st.st_mode)) {
+		static const char *extensions[] = { ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff" };
+
+		DIR *dir = opendir(source);
+		if (!dir)
+			return false;
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL) {
+			string name = entry->d_name;
+			string ext = name.substr(min(name.rfind('.'), name.size()));
+			transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+			for (int i=0;i<sizeof(extensions)/sizeof(extensions[0]);i++) {
+				if (ext == extensions[i]) {
+					paths.push_back(string(source) + "/" + name);
+					break;
+				}
+			}
+		}
+		closedir(dir);
+		sort(paths.begin(), paths.end());
+		return true;
+	}
+
+	FILE *file = fopen(source, "r");
+	if (!file)
+		return false;
+	char line[4096];
+	while (fgets(line, sizeof(line), file)) {
+		// Strip trailing whitespace, skip blank lines and comments
+		string path = line;
+		path.erase(path.find_last_not_of(" \t\r\n") + 1);
+		if (path.empty() || path[0] == '#')
+			continue;
+		paths.push_back(path);
+	}
+	fclose(file);
+	return true;
+}
+
+/*
+ * Progress of a count-batch run, shared by its workers
+ */
+struct CountBatchState
+{
+	int next;						// Next image to count
+	int printed;					// Number of results printed
+	vector<string> results;
+	vector<bool> done;
+	pthread_mutex_t lock;			// Protects results, done and printing
+};
+
+/*
+ * Worker of count-batch. Each worker takes the next image to count until there
+ * are none left, so that slow images do not hold up the others. Results are 
+ * printed in the order of the images, as soon as all earlier ones are done.
+ */
+class CountBatchBody : public ParallelLoopBody
+{
+public:
+	CountBatchBody(ColonyCounter& colonyCounter, const vector<string>& paths, CountBatchState& state) :
+		colonyCounter(colonyCounter), paths(paths), state(state) {
+	}
+
+	void operator()(const Range& range) const {
+		// Buffers of this worker, reused for each of its images
+		ColonyWorkspace workspace;
+
+		while (true) {
+			int i = __sync_fetch_and_add(&state.next, 1);
+			if (i >= paths.size())
+				break;
+
+			char *args[] = { (char*)paths[i].c_str() };
+			ConsoleOpenCVActivityContext context(1, args, false);
+			context.traceFromEnvironment();
+			try {
+				analyseECPlate(context, colonyCounter, &workspace);
+			}
+			catch (cv::Exception& e) {
+				context.setReturnValue("{\"error\":\"Image could not be analysed\"}");
+			}
+			catch (std::exception& e) {
+				context.setReturnValue("{\"error\":\"Image could not be analysed\"}");
+			}
+
+			pthread_mutex_lock(&state.lock);
+			state.results[i] = context.returnValue;
+			state.done[i] = true;
+			while (state.printed < paths.size() && state.done[state.printed]) {
+				printf("%s\n", state.results[state.printed].c_str());
+				state.printed++;
+			}
+			fflush(stdout);
+			pthread_mutex_unlock(&state.lock);
+		}
+	}
+
+private:
+	ColonyCounter& colonyCounter;
+	const vector<string>& paths;
+	CountBatchState& state;
+};
+
+/*
+ * Counts all images of a directory or manifest file, printing one JSON result
+ * per line in the same form as count. The training is loaded once and shared
+ * by numThreads workers (0 for all cores).
+ */
+void runCountBatch(const char *source, int numThreads)
+{
+	vector<string> paths;
+	if (!readBatchPaths(source, paths)) {
+		fprintf(stderr, "Could not read images from %s\n", source);
+		return;
+	}
+
+	ColonyCounter colonyCounter;
+	if (!loadECPlateTraining(colonyCounter)) {
+		fprintf(stderr, "Could not load model\n");
+		return;
+	}
+
+	// One worker for each band that parallelForBands runs
+	numThreads = bandCount((int)paths.size(), numThreads);
+
+	CountBatchState state;
+	state.next = 0;
+	state.printed = 0;
+	state.results.resize(paths.size());
+	state.done.resize(paths.size(), false);
+	pthread_mutex_init(&state.lock, NULL);
+
+	double t0 = (double)getTickCount();
+	parallelForBands(numThreads, numThreads, CountBatchBody(colonyCounter, paths, state));
+	double seconds = ((double)getTickCount() - t0)/getTickFrequency();
+
+	pthread_mutex_destroy(&state.lock);
+
+	fprintf(stderr, "Counted %d images in %.2f s with %d threads (%.2f images/s)\n", (int)paths.size(), 
+		seconds, numThreads, seconds > 0 ? paths.size() / seconds : 0.0);
+}
+
+/*
+ * Counts all images of a directory or manifest file with the staged pipeline.
+ * threads optionally gives the threads of each stage as decode,detect,classify,count
+ */
+void runCountPipeline(const char *source, const char *threads)
+{
+	vector<string> paths;
+	if (!readBatchPaths(source, paths)) {
+		fprintf(stderr, "Could not read images from %s\n", source);
+		return;
+	}
+
+	PipelineParams params;
+	if (threads && sscanf(threads, "%d,%d,%d,%d", &params.decodeThreads, &params.detectThreads, 
+		&params.classifyThreads, &params.countThreads) != 4) {
+		fprintf(stderr, "Threads must be given as decode,detect,classify,count\n");
+		return;
+	}
+
+	runPipeline(paths, params);
+}
+
 int main(int argc, char* argv[])
 {
 	if (argc == 1) {
 		char *appname = "ECPlates";
 		printf("Usage:\n");
-		printf(" %s count <image name> [<colony image file>] [<petri image file>]\nCounts colonies in an image, saving output to optional files\n\n", appname);
+		printf(" %s count <image name> [<colony image file>] [<petri image file>]\nCounts colonies in an image, saving output to optional files. If EC_PLATES_TRACE names a directory,\na Chrome trace of the stages is written there for each image (also for count-batch and serve).\nIf EC_PLATES_COLONIES is set, results also list each colony (also for count-batch, count-pipeline and serve)\n\n", appname);
+		printf(" %s count-batch <image directory or manifest file> [<threads>]\nCounts colonies in many images, printing one result per line\n\n", appname);
+		printf(" %s count-pipeline <image directory or manifest file> [<decode>,<detect>,<classify>,<count>]\nCounts colonies in many images with overlapped stages, using the given threads per stage\n\n", appname);
+		printf(" %s serve <socket path>|-\nServes count requests on a Unix domain socket or stdin/stdout. See server.cpp\n\n", appname);
 		printf(" %s count-gui <image name> [<colony image file>] [<petri image file>]\nCounts colonies in an image with a gui, saving output to optional files\n\n", appname);
-		printf(" %s train\nRun training (advanced)\n\n", appname);
+		printf(" %s train [<quantization> ...]\nRun training, also writing lookup tables of the given quantizations (e.g. 1024 or 1024x512) (advanced)\n\n", appname);
+		printf(" %s write-model <model file>\nWrites the built in lookup table as a binary model file, for use with EC_PLATES_MODEL (advanced)\n\n", appname);
 		printf(" %s test\nRun tests (advanced)\n\n", appname);
 		printf(" %s testq\nRun tests using quantized lookup table (advanced)\n\n", appname);
+		printf(" %s testc\nRun tests using the color table built from the quantized lookup table (advanced)\n\n", appname);
 		printf(" %s quant\nRun quantization tests (advanced)\n\n", appname);
 		printf(" %s test-circles\nRun circle tests (advanced)\n\n", appname);
+		printf(" %s test-linear\nCompare linear SVM hyperplanes with the SVM and the quantized lookup (advanced)\n\n", appname);
+		printf(" %s test-background\nCompare reduced scale background estimation with full resolution (advanced)\n\n", appname);
+		printf(" %s bench [<repeats>] [<json file>]\nBenchmark each stage over the test images, writing results as JSON (default bench.json) (advanced)\n\n", appname);
+		printf(" %s bench-classify [<image name>]\nBenchmark pixel classification on a 3000x3000 petri crop (advanced)\n\n", appname);
+		printf(" %s bench-normalize [<image name>]\nBenchmark normalizing a 3000x3000 petri crop against its background (advanced)\n\n", appname);
+		printf(" %s bench-threads [<image name>]\nBenchmark scaling of preprocessing, classification and counting over threads (advanced)\n\n", appname);
+		printf(" %s bench-count [<image name>]\nBenchmark cleaning up and counting colonies on a 3000x3000 petri crop (advanced)\n\n", appname);
+		printf(" %s bench-circles [<image name>]\nBenchmark finding the dish, with and without edge clutter (advanced)\n\n", appname);
+		printf(" %s bench-workspace [<passes>]\nBenchmark heap allocations of classifying and counting the test images, with and without reusing a workspace (advanced)\n\n", appname);
 		return 0;
 	}
 
@@ -259,9 +664,45 @@ int main(int argc, char* argv[])
 			labelPaths.push_back(format("samples/train/%03d_label.png", k));
 		}
 		ColonyCounter colonyCounter;
+		colonyCounter.setNumThreads(0);
+		timeit(NULL);
 		colonyCounter.trainClassifier(trainPaths, labelPaths, NULL);
+		printf("Trained on %d rows for %d unique samples from %ld labelled pixels\n", colonyCounter.getTrainingRows(),
+			colonyCounter.getTrainingSamples(), colonyCounter.getTrainingPixels());
+		timeit("training");
 		colonyCounter.saveTraining("svm_params.yml");
-		colonyCounter.saveTrainingQuantized("svm_table.h", quants);
+		colonyCounter.saveTrainingQuantized("svm_table.h", quants, "svm_model.bin");
+		timeit("lookup table");
+
+		// Finer tables to compare against the default one, e.g. with EC_PLATES_MODEL
+		for (int i=2;i<argc;i++) {
+			int extraQuants[2];
+			if (!parseQuants(argv[i], extraQuants)) {
+				printf("Invalid quantization %s\n", argv[i]);
+				return 1;
+			}
+			string name = format("%dx%d", extraQuants[0], extraQuants[1]);
+			if (!colonyCounter.saveTrainingQuantized(("svm_table_" + name + ".h").c_str(), extraQuants,
+				("svm_model_" + name + ".bin").c_str())) {
+				printf("Could not write lookup table %s\n", name.c_str());
+				return 1;
+			}
+			timeit(("lookup table " + name).c_str());
+		}
+		return 0;
+	}
+
+	if (strcmp(argv[1], "write-model") == 0) {
+		if (argc < 3) {
+			printf("write-model needs a model file\n");
+			return 1;
+		}
+		ColonyCounter colonyCounter;
+		colonyCounter.loadTrainingQuantized(svmLookup, svmQuants);
+		if (!colonyCounter.saveTrainingBinary(argv[2], svmQuants)) {
+			printf("Could not write %s\n", argv[2]);
+			return 1;
+		}
 		return 0;
 	}
 
@@ -273,16 +714,81 @@ int main(int argc, char* argv[])
 		runTestsSVMTable();
 	}
 
+	if (strcmp(argv[1], "testc") == 0) {
+		runTestsColorTable();
+	}
+
 	if (strcmp(argv[1], "test-circles") == 0) {
 		runTestCircles();
 	}
 
+	if (strcmp(argv[1], "test-linear") == 0) {
+		runLinearTests();
+	}
+
+	if (strcmp(argv[1], "test-background") == 0) {
+		runBackgroundTests();
+	}
+
+	if (strcmp(argv[1], "bench") == 0) {
+		runStageBenchmark(argc >= 3 ? atoi(argv[2]) : 20, argc >= 4 ? argv[3] : "bench.json");
+	}
+
+	if (strcmp(argv[1], "bench-classify") == 0) {
+		runClassifyBenchmark(argc >= 3 ? argv[2] : "samples/images/001.jpg");
+	}
+
+	if (strcmp(argv[1], "bench-normalize") == 0) {
+		runNormalizeBenchmark(argc >= 3 ? argv[2] : "samples/images/001.jpg");
+	}
+
+	if (strcmp(argv[1], "bench-threads") == 0) {
+		runThreadScalingBenchmark(argc >= 3 ? argv[2] : "samples/images/001.jpg");
+	}
+
+	if (strcmp(argv[1], "bench-count") == 0) {
+		runCountBenchmark(argc >= 3 ? argv[2] : "samples/images/001.jpg");
+	}
+
+	if (strcmp(argv[1], "bench-circles") == 0) {
+		runCircleBenchmark(argc >= 3 ? argv[2] : "samples/images/001.jpg");
+	}
+
+	if (strcmp(argv[1], "bench-workspace") == 0) {
+		runWorkspaceBenchmark(argc >= 3 ? atoi(argv[2]) : 3);
+	}
+
 	if (strcmp(argv[1], "count") == 0) {
 		ConsoleOpenCVActivityContext context(argc-2, argv+2, false);
+		context.traceFromEnvironment();
 		analyseECPlate(context);
 		printf("%s\n", context.returnValue.c_str());
 	}
 
+	if (strcmp(argv[1], "count-batch") == 0) {
+		if (argc < 3) {
+			printf("count-batch needs an image directory or manifest file\n");
+			return 1;
+		}
+		runCountBatch(argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+	}
+
+	if (strcmp(argv[1], "count-pipeline") == 0) {
+		if (argc < 3) {
+			printf("count-pipeline needs an image directory or manifest file\n");
+			return 1;
+		}
+		runCountPipeline(argv[2], argc >= 4 ? argv[3] : NULL);
+	}
+
+	if (strcmp(argv[1], "serve") == 0) {
+		if (argc < 3) {
+			printf("serve needs a socket path, or - for stdin/stdout\n");
+			return 1;
+		}
+		return runServer(argv[2]);
+	}
+
 	if (strcmp(argv[1], "count-gui") == 0) {
 		DesktopOpenCVActivityContext context(argc-2, argv+2);
 		analyseECPlate(context);
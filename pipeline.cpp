@@ -0,0 +1,383 @@
+#include "stdafx.h"
+#include <opencv2/opencv.hpp>
+
+#include "CircleFinder.h"
+#include "ColonyCounter.h"
+#include "algorithm.h"
+#include "pipeline.h"
+
+#include <deque>
+#include <pthread.h>
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Pipeline for counting many images. Each image passes through these stages:
+ *
+ * 1) decode: read and decode the image file
+ * 2) detect: find the Petri dish
+ * 3) classify: preprocess and classify the pixels of the dish
+ * 4) count: count the colonies
+ *
+ * A stage which fails for an image sets its result, and later stages pass it
+ * on unchanged. Results are the same as those of analyseECPlate.
+ */
+
+PipelineParams::PipelineParams()
+{
+	decodeThreads = 2;
+	detectThreads = 2;
+	classifyThreads = 2;
+	countThreads = 1;
+	queueSize = 4;
+}
+
+/*
+ * Queue of limited size between threads. Producers wait while it is full, and
+ * consumers wait while it is empty. Once every producer is done, consumers get
+ * what is left and then stop.
+ */
+template<class T>
+class BlockingQueue
+{
+public:
+	BlockingQueue(int capacity) : capacity(capacity), producers(0), closed(false),
+		pushes(0), depthTotal(0), maxDepth(0) {
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&notEmpty, NULL);
+		pthread_cond_init(&notFull, NULL);
+	}
+
+	~BlockingQueue() {
+		pthread_cond_destroy(&notFull);
+		pthread_cond_destroy(&notEmpty);
+		pthread_mutex_destroy(&lock);
+	}
+
+	// Adds an item, waiting while the queue is full
+	void push(const T& item) {
+		pthread_mutex_lock(&lock);
+		while (items.size() >= capacity)
+			pthread_cond_wait(&notFull, &lock);
+		items.push_back(item);
+
+		pushes++;
+		depthTotal += items.size();
+		maxDepth = max(maxDepth, (int)items.size());
+
+		pthread_cond_signal(&notEmpty);
+		pthread_mutex_unlock(&lock);
+	}
+
+	// Takes the oldest item, waiting while the queue is empty. Returns false when
+	// the queue is empty and all producers are done
+	bool pop(T& item) {
+		pthread_mutex_lock(&lock);
+		while (items.empty() && !closed)
+			pthread_cond_wait(&notEmpty, &lock);
+		bool got = !items.empty();
+		if (got) {
+			item = items.front();
+			items.pop_front();
+			pthread_cond_signal(&notFull);
+		}
+		pthread_mutex_unlock(&lock);
+		return got;
+	}
+
+	// Registers a producer. Must be called before the producer starts
+	void addProducer() {
+		pthread_mutex_lock(&lock);
+		producers++;
+		pthread_mutex_unlock(&lock);
+	}
+
+	// Called by each producer once it has pushed all of its items
+	void producerDone() {
+		pthread_mutex_lock(&lock);
+		if (--producers == 0) {
+			closed = true;
+			pthread_cond_broadcast(&notEmpty);
+		}
+		pthread_mutex_unlock(&lock);
+	}
+
+	// Average number of items in the queue, seen by each item as it was added
+	double meanDepth() const {
+		return pushes > 0 ? depthTotal * 1.0 / pushes : 0;
+	}
+
+	// Most items ever in the queue at once
+	int peakDepth() const {
+		return maxDepth;
+	}
+
+private:
+	deque<T> items;
+	size_t capacity;
+	int producers;
+	bool closed;
+
+	long pushes;
+	long depthTotal;
+	int maxDepth;
+
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+};
+
+/*
+ * An image on its way through the pipeline
+ */
+struct PlateJob
+{
+	int index;			// Index of the image
+	Mat img;			// Decoded image
+	Mat petri;			// Dish within img
+	Mat classified;		// Classified dish
+	string result;		// JSON result, once known
+};
+
+typedef BlockingQueue<PlateJob> JobQueue;
+
+/*
+ * A stage of the pipeline, run by a number of threads. Each thread takes
+ * images from the input queue, processes them and adds them to the output queue.
+ */
+class PipelineStage
+{
+public:
+	PipelineStage(const char *name, int numThreads, JobQueue& in, JobQueue& out) :
+		name(name), numThreads(max(numThreads, 1)), in(in), out(out), busy(0) {
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	virtual ~PipelineStage() {
+		pthread_mutex_destroy(&lock);
+	}
+
+	// Starts the threads of the stage
+	void start() {
+		for (int i=0;i<numThreads;i++)
+			out.addProducer();
+
+		threads.resize(numThreads);
+		int started = 0;
+		for (int i=0;i<numThreads;i++) {
+			if (pthread_create(&threads[started], NULL, run, this) == 0)
+				started++;
+			else
+				out.producerDone();
+		}
+		threads.resize(started);
+
+		// Without any thread the pipeline would never finish
+		if (started == 0) {
+			fprintf(stderr, "Could not start %s stage\n", name);
+			exit(1);
+		}
+	}
+
+	// Waits for the threads of the stage to finish
+	void join() {
+		for (int i=0;i<threads.size();i++)
+			pthread_join(threads[i], NULL);
+	}
+
+	// Fraction of the time that the threads of the stage were busy
+	double utilization(double seconds) const {
+		return seconds > 0 ? busy / (seconds * threads.size()) : 0;
+	}
+
+	const char *name;
+	int numThreads;
+	JobQueue& in;
+
+protected:
+	// Processes an image which has not failed in an earlier stage, with the
+	// buffers of the thread
+	virtual void process(PlateJob& job, ColonyWorkspace& workspace) = 0;
+
+private:
+	static void* run(void *arg) {
+		((PipelineStage*)arg)->work();
+		return NULL;
+	}
+
+	void work() {
+		double threadBusy = 0;
+		ColonyWorkspace workspace;
+		PlateJob job;
+		while (in.pop(job)) {
+			double t0 = (double)getTickCount();
+			if (job.result.empty()) {
+				try {
+					process(job, workspace);
+				}
+				catch (cv::Exception& e) {
+					job.result = "{\"error\":\"Image could not be analysed\"}";
+				}
+				catch (std::exception& e) {
+					job.result = "{\"error\":\"Image could not be analysed\"}";
+				}
+			}
+			threadBusy += ((double)getTickCount() - t0)/getTickFrequency();
+			out.push(job);
+		}
+		out.producerDone();
+
+		pthread_mutex_lock(&lock);
+		busy += threadBusy;
+		pthread_mutex_unlock(&lock);
+	}
+
+	JobQueue& out;
+	vector<pthread_t> threads;
+	double busy;				// Total seconds spent processing by all threads
+	pthread_mutex_t lock;		// Protects busy
+};
+
+class DecodeStage : public PipelineStage
+{
+public:
+	DecodeStage(int numThreads, JobQueue& in, JobQueue& out, const vector<string>& paths) :
+		PipelineStage("decode", numThreads, in, out), paths(paths) {
+	}
+
+protected:
+	void process(PlateJob& job, ColonyWorkspace& workspace) {
+		job.img = imread(paths[job.index]);
+		if (job.img.empty())
+			job.result = "{\"error\":\"Image file not found\"}";
+	}
+
+private:
+	const vector<string>& paths;
+};
+
+class DetectStage : public PipelineStage
+{
+public:
+	DetectStage(int numThreads, JobQueue& in, JobQueue& out) :
+		PipelineStage("detect", numThreads, in, out) {
+	}
+
+protected:
+	void process(PlateJob& job, ColonyWorkspace& workspace) {
+		Rect petriRect = findPetriRect(job.img);
+		if (petriRect.height == 0)
+			job.result = "{\"error\":\"EC Plate not detected\"}";
+		else
+			job.petri = job.img(petriRect);
+	}
+};
+
+class ClassifyStage : public PipelineStage
+{
+public:
+	ClassifyStage(int numThreads, JobQueue& in, JobQueue& out, ColonyCounter& colonyCounter) :
+		PipelineStage("classify", numThreads, in, out), colonyCounter(colonyCounter) {
+	}
+
+protected:
+	void process(PlateJob& job, ColonyWorkspace& workspace) {
+		colonyCounter.classifyPetri(job.petri, job.classified, workspace);
+
+		// The image is no longer needed
+		job.petri.release();
+		job.img.release();
+	}
+
+private:
+	ColonyCounter& colonyCounter;
+};
+
+class CountStage : public PipelineStage
+{
+public:
+	CountStage(int numThreads, JobQueue& in, JobQueue& out, ColonyCounter& colonyCounter) :
+		PipelineStage("count", numThreads, in, out), colonyCounter(colonyCounter) {
+	}
+
+protected:
+	void process(PlateJob& job, ColonyWorkspace& workspace) {
+		vector<Colony>& colonies = workspace.colonies;
+		colonyCounter.countColonies(job.classified, colonies, workspace);
+		job.classified.release();
+
+		int red = 0, blue = 0;
+		for (int i=0;i<colonies.size();i++)
+			(colonies[i].type == 1 ? red : blue)++;
+		job.result = formatECPlateResult(red, blue, wantECPlateColonies() ? &colonies : NULL);
+	}
+
+private:
+	ColonyCounter& colonyCounter;
+};
+
+void runPipeline(const vector<string>& paths, const PipelineParams& params)
+{
+	ColonyCounter colonyCounter;
+	if (!loadECPlateTraining(colonyCounter)) {
+		fprintf(stderr, "Could not load model\n");
+		return;
+	}
+
+	// Queue of all images to decode, and queues after each stage
+	JobQueue input(max((int)paths.size(), 1));
+	JobQueue decoded(params.queueSize), detected(params.queueSize);
+	JobQueue classified(params.queueSize), counted(params.queueSize);
+
+	input.addProducer();
+	for (int i=0;i<paths.size();i++) {
+		PlateJob job;
+		job.index = i;
+		input.push(job);
+	}
+	input.producerDone();
+
+	DecodeStage decode(params.decodeThreads, input, decoded, paths);
+	DetectStage detect(params.detectThreads, decoded, detected);
+	ClassifyStage classify(params.classifyThreads, detected, classified, colonyCounter);
+	CountStage count(params.countThreads, classified, counted, colonyCounter);
+	PipelineStage *stages[] = { &decode, &detect, &classify, &count };
+	const int numStages = 4;
+
+	double t0 = (double)getTickCount();
+	for (int i=0;i<numStages;i++)
+		stages[i]->start();
+
+	// Print results in the order of the images
+	vector<string> results(paths.size());
+	vector<bool> done(paths.size(), false);
+	int printed = 0;
+	PlateJob job;
+	while (counted.pop(job)) {
+		results[job.index] = job.result;
+		done[job.index] = true;
+		while (printed < paths.size() && done[printed]) {
+			printf("%s\n", results[printed].c_str());
+			printed++;
+		}
+		fflush(stdout);
+	}
+
+	for (int i=0;i<numStages;i++)
+		stages[i]->join();
+	double seconds = ((double)getTickCount() - t0)/getTickFrequency();
+
+	fprintf(stderr, "Counted %d images in %.2f s (%.2f images/s)\n", (int)paths.size(),
+		seconds, seconds > 0 ? paths.size() / seconds : 0.0);
+	fprintf(stderr, "%-10s %8s %12s %16s\n", "stage", "threads", "utilization", "queue mean/peak");
+	for (int i=0;i<numStages;i++) {
+		// The input of the first stage holds all images, so its depth says nothing
+		if (i == 0)
+			fprintf(stderr, "%-10s %8d %11.0f%% %16s\n", stages[i]->name, stages[i]->numThreads,
+				stages[i]->utilization(seconds) * 100, "-");
+		else
+			fprintf(stderr, "%-10s %8d %11.0f%% %11.1f/%-4d\n", stages[i]->name, stages[i]->numThreads,
+				stages[i]->utilization(seconds) * 100, stages[i]->in.meanDepth(), stages[i]->in.peakDepth());
+	}
+}
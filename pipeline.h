@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/*
+ * Staged pipeline for counting many images. Decoding, finding the dish,
+ * classifying and counting each run on their own threads, with bounded queues
+ * between them, so that reading later images overlaps with classifying earlier
+ * ones. See pipeline.cpp
+ */
+
+// Number of threads of each stage and the size of the queues between stages
+struct PipelineParams
+{
+	PipelineParams();
+
+	int decodeThreads;
+	int detectThreads;
+	int classifyThreads;
+	int countThreads;
+	int queueSize;
+};
+
+// Counts the images, printing one JSON result per line in the order of the
+// images, then the utilization and queue depth of each stage to stderr
+void runPipeline(const std::vector<std::string>& paths, const PipelineParams& params);
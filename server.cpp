@@ -0,0 +1,232 @@
+#include "stdafx.h"
+#include <opencv2/opencv.hpp>
+
+#include "ColonyCounter.h"
+#include "OpenCVActivityContext.h"
+#include "algorithm.h"
+#include "server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace cv;
+
+/*
+ * Analysis server. Model loading and OpenCV initialization happen once, after
+ * which each request only costs the analysis itself.
+ *
+ * Protocol: each request is one line, answered by one line of JSON in the same
+ * form as the count command prints.
+ *
+ *  path <image file>\n			Analyzes an image file
+ *  data <length>\n<bytes>		Analyzes an encoded image (e.g. JPEG) of length bytes
+ *  reload [<model file>]\n		Loads a binary model file, by default the one loaded at
+ *								startup, for all later requests
+ *
+ * On a socket, each connection can send any number of requests, which are
+ * answered in order. Connections are served concurrently.
+ */
+
+// Largest encoded image accepted in a data request
+static const long MAX_DATA_LENGTH = 64 * 1024 * 1024;
+
+// Colony counter shared by all connections. Requests hold a reference to the
+// counter they started with, so a reload does not affect requests in progress
+static Ptr<ColonyCounter> sharedCounter;
+static pthread_mutex_t counterLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Gets the current colony counter
+ */
+static Ptr<ColonyCounter> currentCounter()
+{
+	pthread_mutex_lock(&counterLock);
+	Ptr<ColonyCounter> counter = sharedCounter;
+	pthread_mutex_unlock(&counterLock);
+	return counter;
+}
+
+/*
+ * Loads a new colony counter, from a binary model file if modelPath is not empty
+ * and otherwise as loadECPlateTraining does, and makes it current. Returns false,
+ * keeping the current counter, if it could not be loaded.
+ */
+static bool loadCounter(const string& modelPath)
+{
+	Ptr<ColonyCounter> counter = new ColonyCounter();
+	if (modelPath.empty() ? !loadECPlateTraining(*counter) : !counter->loadTrainingBinary(modelPath.c_str()))
+		return false;
+	counter->buildColorTable(ColonyCounter::COLOR_TABLE_FULL);
+
+	pthread_mutex_lock(&counterLock);
+	sharedCounter = counter;
+	pthread_mutex_unlock(&counterLock);
+	return true;
+}
+
+/*
+ * Handles a single request line, reading any image data which follows it.
+ * Returns the reply, or an empty string if the connection can not continue.
+ */
+static string handleRequest(const char *line, FILE *in, ColonyWorkspace& workspace)
+{
+	Ptr<ColonyCounter> colonyCounter = currentCounter();
+
+	if (strncmp(line, "path ", 5) == 0) {
+		char *args[] = { (char*)line + 5 };
+		ConsoleOpenCVActivityContext context(1, args, false);
+		context.traceFromEnvironment();
+		analyseECPlate(context, *colonyCounter, &workspace);
+		return context.returnValue;
+	}
+
+	if (strncmp(line, "data ", 5) == 0) {
+		char *end;
+		long length = strtol(line + 5, &end, 10);
+		if (end == line + 5 || *end != 0 || length <= 0 || length > MAX_DATA_LENGTH)
+			return "";
+
+		vector<uchar> data(length);
+		if (fread(&data[0], 1, length, in) != length)
+			return "";
+
+		Mat img = imdecode(Mat(data), CV_LOAD_IMAGE_COLOR);
+		if (img.empty())
+			return "{\"error\":\"Image could not be decoded\"}";
+
+		ConsoleOpenCVActivityContext context(0, NULL, false);
+		context.traceFromEnvironment();
+		analyseECPlate(context, *colonyCounter, img, &workspace);
+		return context.returnValue;
+	}
+
+	if (strcmp(line, "reload") == 0 || strncmp(line, "reload ", 7) == 0) {
+		if (!loadCounter(line[6] ? line + 7 : ""))
+			return "{\"error\":\"Model could not be loaded\"}";
+		return "{\"reloaded\": true}";
+	}
+
+	return "{\"error\":\"Unknown request\"}";
+}
+
+/*
+ * Answers requests from in on out until in is closed or a request is malformed
+ */
+static void serveConnection(FILE *in, FILE *out)
+{
+	// Buffers reused for each request of the connection
+	ColonyWorkspace workspace;
+
+	char line[4096];
+	while (fgets(line, sizeof(line), in)) {
+		// Strip line ending
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == 0)
+			continue;
+
+		string reply;
+		try {
+			reply = handleRequest(line, in, workspace);
+		}
+		catch (cv::Exception& e) {
+			reply = "{\"error\":\"Image could not be analysed\"}";
+		}
+		catch (std::exception& e) {
+			reply = "{\"error\":\"Image could not be analysed\"}";
+		}
+
+		if (reply.empty()) {
+			fprintf(out, "{\"error\":\"Malformed request\"}\n");
+			fflush(out);
+			break;
+		}
+		fprintf(out, "%s\n", reply.c_str());
+		if (fflush(out) != 0)
+			break;
+	}
+}
+
+/*
+ * Thread serving one socket connection
+ */
+static void* connectionThread(void *arg)
+{
+	int fd = (int)(long)arg;
+	FILE *in = fdopen(fd, "r");
+	FILE *out = in ? fdopen(dup(fd), "w") : NULL;
+	if (in && out)
+		serveConnection(in, out);
+
+	if (out)
+		fclose(out);
+	if (in)
+		fclose(in);
+	else
+		close(fd);
+	return NULL;
+}
+
+int runServer(const char *socketPath)
+{
+	if (!loadCounter("")) {
+		fprintf(stderr, "Could not load model\n");
+		return 1;
+	}
+
+	if (strcmp(socketPath, "-") == 0) {
+		serveConnection(stdin, stdout);
+		return 0;
+	}
+
+	// Replies to clients which have gone away should fail, not end the server
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", socketPath);
+		return 1;
+	}
+	strcpy(addr.sun_path, socketPath);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(socketPath);
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+		perror(socketPath);
+		close(listener);
+		return 1;
+	}
+
+	fprintf(stderr, "Serving on %s\n", socketPath);
+	while (true) {
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, connectionThread, (void*)(long)fd) != 0)
+			close(fd);
+		pthread_attr_destroy(&attr);
+	}
+
+	close(listener);
+	unlink(socketPath);
+	return 1;
+}
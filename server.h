@@ -0,0 +1,10 @@
+#pragma once
+
+/*
+ * Analysis server which keeps the training loaded between requests. See server.cpp
+ * for the protocol.
+ */
+
+// Serves requests on a Unix domain socket at socketPath, or on stdin/stdout if
+// socketPath is "-". Only returns if the server cannot be started.
+int runServer(const char *socketPath);